@@ -55,7 +55,9 @@
 
 MODULE_AUTHOR  ("Dmitry Denisenko");
 MODULE_DESCRIPTION ("Driver for Intel(R) OpenCL Acceleration Boards");
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
 MODULE_SUPPORTED_DEVICE ("Intel(R) OpenCL Boards");
+#endif
 MODULE_LICENSE("GPL");
 
 
@@ -100,6 +102,11 @@ struct file_operations aclpci_fileops = {
   .owner =    THIS_MODULE,
   .read =     aclpci_read,
   .write =    aclpci_write,
+  .mmap =     aclpci_mmap,
+  .poll =     aclpci_poll,
+#if ACL_URING_CMD
+  .uring_cmd = aclpci_uring_cmd,
+#endif
 /*  .ioctl =    aclpci_ioctl, */
   .open =     aclpci_open,
   .release =  aclpci_close,
@@ -134,6 +141,71 @@ static unsigned int aclpci_get_free(void)
   return i;
 }
 
+/* sysfs attributes of the device: the global memory transfer thresholds,
+ * which can be written to override the defaults or the calibration, and the
+ * calibration results as bandwidths. */
+#define ACL_THRESHOLD_ATTR(name, field, reading)                                      \
+static ssize_t name##_show (struct device *dev, struct device_attribute *attr,       \
+                            char *buf) {                                              \
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)dev_get_drvdata(dev);              \
+  return sprintf(buf, "%lu\n", aclpci->field[reading]);                              \
+}                                                                                     \
+static ssize_t name##_store (struct device *dev, struct device_attribute *attr,      \
+                             const char *buf, size_t count) {                         \
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)dev_get_drvdata(dev);              \
+  unsigned long val;                                                                  \
+  if (kstrtoul(buf, 0, &val)) {                                                       \
+    return -EINVAL;                                                                   \
+  }                                                                                   \
+  aclpci->field[reading] = val;                                                       \
+  return count;                                                                       \
+}                                                                                     \
+static DEVICE_ATTR(name, 0644, name##_show, name##_store)
+
+ACL_THRESHOLD_ATTR(dma_min_write, dma_min, 0);
+ACL_THRESHOLD_ATTR(dma_min_read, dma_min, 1);
+ACL_THRESHOLD_ATTR(dma_pin_min_write, dma_pin_min, 0);
+ACL_THRESHOLD_ATTR(dma_pin_min_read, dma_pin_min, 1);
+
+/* One line per size: bandwidth in MB/s of each method, writes then reads.
+ * 0 where not measured. */
+static ssize_t dma_calibration_show (struct device *dev, struct device_attribute *attr, char *buf) {
+
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)dev_get_drvdata(dev);
+  ssize_t len;
+  size_t size;
+  u64 ns;
+  int i, reading, method;
+
+  len = sprintf(buf, "size pio_wr bounce_wr pinned_wr pio_rd bounce_rd pinned_rd\n");
+  for (i = 0; i < ACL_CALIB_SIZES; i++) {
+    size = (size_t)ACL_CALIB_MIN_SIZE << i;
+    len += sprintf(buf + len, "%lu", size);
+    for (reading = 0; reading < 2; reading++) {
+      for (method = 0; method < ACL_CALIB_METHODS; method++) {
+        ns = aclpci->calib_ns[method][reading][i];
+        len += sprintf(buf + len, " %llu", ns ? div64_u64((u64)size * 1000, ns) : 0);
+      }
+    }
+    len += sprintf(buf + len, "\n");
+  }
+  return len;
+}
+static DEVICE_ATTR(dma_calibration, 0444, dma_calibration_show, NULL);
+
+static struct attribute *aclpci_attrs[] = {
+  &dev_attr_dma_min_write.attr,
+  &dev_attr_dma_min_read.attr,
+  &dev_attr_dma_pin_min_write.attr,
+  &dev_attr_dma_pin_min_read.attr,
+  &dev_attr_dma_calibration.attr,
+  NULL,
+};
+
+/* Attached to the class, so they exist before the uevent for the device. */
+ATTRIBUTE_GROUPS(aclpci);
+
+
 /* Allocate /dev/BOARD_NAME device */
 static int MY_INIT init_chrdev (struct aclpci_dev *aclpci) {
 
@@ -166,7 +238,7 @@ static int MY_INIT init_chrdev (struct aclpci_dev *aclpci) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 26)
   aclpci->device = device_create(aclpci_class, NULL, devno, BOARD_NAME "%d", dev_minor);
 #else
-  aclpci->device = device_create(aclpci_class, NULL, devno, NULL, BOARD_NAME "%d", dev_minor);
+  aclpci->device = device_create(aclpci_class, NULL, devno, aclpci, BOARD_NAME "%d", dev_minor);
 #endif
   if (IS_ERR(aclpci->device)) {
     printk(KERN_NOTICE "Can't create device\n");
@@ -249,33 +321,26 @@ void unmask_kernel_irq(struct aclpci_dev *aclpci) {
 //
 // Given irq status, determine type of interrupt
 // Result is returned in kernel_update/dma_update arguments.
+// Both DMA directions can be busy at once, so dma_update has bit 'reading'
+// set for each channel whose last descriptor is done.
 // Using 'int' instead of 'bool' for returns because the kernel code
 // is pure C and doesn't support bools.
 void get_interrupt_type (struct aclpci_dma *aclpci_dma_data, unsigned int irq_status,
                          unsigned int *kernel_update, unsigned int *dma_update)
 {
    int dma_last_id, reading;
+   struct aclpci_dma_chan *c;
    *kernel_update = ACL_PCIE_READ_BIT( irq_status, ACL_PCIE_KERNEL_IRQ_VEC );
 
-   reading = aclpci_dma_data->m_read;
-
-   if (reading) {
-     if (aclpci_dma_data->dma_wr_last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES) {
-       dma_last_id = aclpci_dma_data->dma_wr_last_id;
-       *dma_update = (aclpci_dma_data->desc_table_wr_cpu_virt_addr->header.flags[dma_last_id]);
-     } else {
-       *dma_update = 0;
-     }
-   } else {
-     if (aclpci_dma_data->dma_rd_last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES) {
-       dma_last_id = aclpci_dma_data->dma_rd_last_id;
-       *dma_update = (aclpci_dma_data->desc_table_rd_cpu_virt_addr->header.flags[dma_last_id]);
-     } else {
-       *dma_update = 0;
+   *dma_update = 0;
+   for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+     c = &(aclpci_dma_data->m_chan[reading]);
+     dma_last_id = c->last_id;
+     if (dma_last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES &&
+         c->desc_table->header.flags[dma_last_id]) {
+       *dma_update |= (1 << reading);
      }
    }
-
-
 }
 
 
@@ -334,8 +399,12 @@ irqreturn_t aclpci_irq (int irq, void *dev_id) {
   if (kernel_update) {
 
   mask_kernel_irq(aclpci);
+  aclpci->kernel_irq_pending = 1;
+  WRITE_ONCE(aclpci->status_page->kernel_irq_pending, 1);
+  WRITE_ONCE(aclpci->status_page->kernel_irq_count, aclpci->status_page->kernel_irq_count + 1);
+  wake_up_all(&aclpci->wait_q);
   #if !POLLING
-    if (aclpci->user_task != NULL) {
+    if (!aclpci_signal_eventfd(aclpci, ACLPCI_EVENT_KERNEL) && aclpci->user_task != NULL) {
       // int ret = send_sig_info(aclpci->signal_number, &aclpci->signal_info, aclpci->user_task);
       struct kernel_siginfo *tmp_alcpci_sig_inf = &aclpci->signal_info;
       int ret = send_sig_info(aclpci->signal_number, tmp_alcpci_sig_inf, aclpci->user_task);
@@ -359,12 +428,25 @@ irqreturn_t aclpci_irq (int irq, void *dev_id) {
   if (dma_update) {
     /* A DMA-status interrupt - let the DMA object handle this without going to
       * user space */
-    res = aclpci_dma_service_interrupt(aclpci);
+    res = aclpci_dma_service_interrupt(aclpci, dma_update);
   }
   return res;
 }
 
 
+/* Runs when aclpci_irq() returns IRQ_WAKE_THREAD. The IRQ thread is a
+ * SCHED_FIFO kernel thread, and runs on the CPUs in the IRQ's affinity mask. */
+irqreturn_t aclpci_irq_thread (int irq, void *dev_id) {
+
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)dev_id;
+
+  if (aclpci == NULL) {
+    return IRQ_NONE;
+  }
+  return aclpci_dma_irq_thread(aclpci);
+}
+
+
 void load_signal_info (struct aclpci_dev *aclpci) {
 
   /* Setup siginfo struct to send signal to user process. Doing it once here
@@ -389,6 +471,54 @@ void load_signal_info (struct aclpci_dev *aclpci) {
 }
 
 
+/* Register (fd >= 0) or drop (fd < 0) the eventfd for an event */
+int aclpci_set_eventfd (struct aclpci_dev *aclpci, unsigned long event, int fd) {
+
+  struct eventfd_ctx *ctx = NULL;
+  unsigned long flags;
+
+  if (event >= ACLPCI_NUM_EVENTS) {
+    return -EINVAL;
+  }
+  if (fd >= 0) {
+    ctx = eventfd_ctx_fdget(fd);
+    if (IS_ERR(ctx)) {
+      return PTR_ERR(ctx);
+    }
+  }
+
+  spin_lock_irqsave(&aclpci->event_lock, flags);
+  swap(ctx, aclpci->eventfd[event]);
+  spin_unlock_irqrestore(&aclpci->event_lock, flags);
+
+  if (ctx != NULL) {
+    eventfd_ctx_put(ctx);
+  }
+  return 0;
+}
+
+
+/* Signal the eventfd for an event. Returns 0 if none is registered, so the
+ * caller can fall back to a signal. Safe in interrupt context. */
+int aclpci_signal_eventfd (struct aclpci_dev *aclpci, unsigned int event) {
+
+  unsigned long flags;
+  int registered;
+
+  spin_lock_irqsave(&aclpci->event_lock, flags);
+  registered = (aclpci->eventfd[event] != NULL);
+  if (registered) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(aclpci->eventfd[event]);
+#else
+    eventfd_signal(aclpci->eventfd[event], 1);
+#endif
+  }
+  spin_unlock_irqrestore(&aclpci->event_lock, flags);
+  return registered;
+}
+
+
 int init_irq (struct pci_dev *dev, void *dev_id) {
 
   u32 irq_type;
@@ -405,8 +535,7 @@ int init_irq (struct pci_dev *dev, void *dev_id) {
   if(pci_enable_msi(dev) != 0){
     ACL_DEBUG (KERN_WARNING "Could not enable MSI");
   }
-  if (!pci_set_dma_mask(dev, DMA_BIT_MASK(64))) {
-    pci_set_consistent_dma_mask(dev, DMA_BIT_MASK(64));
+  if (!dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64))) {
     ACL_DEBUG (KERN_WARNING "using a 64-bit irq mask\n");
   } else {
     ACL_DEBUG (KERN_WARNING "unable to use 64-bit irq mask\n");
@@ -434,7 +563,7 @@ int init_irq (struct pci_dev *dev, void *dev_id) {
   ACL_VERBOSE_DEBUG (KERN_WARNING "irq line: %d\n", aclpci->irq_line);
   ACL_VERBOSE_DEBUG (KERN_WARNING "irq: %d\n", dev->irq);
 
-  rc = request_irq (dev->irq, aclpci_irq, irq_type, DRIVER_NAME, dev_id);
+  rc = request_threaded_irq (dev->irq, aclpci_irq, aclpci_irq_thread, irq_type, DRIVER_NAME, dev_id);
   if (rc) {
     ACL_DEBUG (KERN_WARNING "Could not request IRQ #%d, error %d", dev->irq, rc);
     return -1;
@@ -562,6 +691,8 @@ static int MY_PROBE probe(struct pci_dev *dev, const struct pci_device_id *id) {
 
   spin_lock_init(&aclpci->lock);
   sema_init (&aclpci->sem, 1);
+  init_waitqueue_head (&aclpci->wait_q);
+  spin_lock_init (&aclpci->event_lock);
   aclpci->pci_dev = dev;
   dev_set_drvdata(&dev->dev, (void*)aclpci);
   aclpci->user_pid = -1;
@@ -570,6 +701,7 @@ static int MY_PROBE probe(struct pci_dev *dev, const struct pci_device_id *id) {
   aclpci->upstream = find_upstream_dev (dev);
   aclpci->num_handles_open = 0;
   aclpci->signal_number = SIG_INT_NOTIFY;   //new mmd will overwrite this, just safety for compatibility with new driver / old mmd
+  aclpci_init_thresholds (aclpci);
 
   retrain_gen2 (aclpci);
 
@@ -579,6 +711,12 @@ static int MY_PROBE probe(struct pci_dev *dev, const struct pci_device_id *id) {
     goto fail_kmalloc;
   }
 
+  aclpci->status_page = (struct acl_status_page *)get_zeroed_page (GFP_KERNEL);
+  if (!aclpci->status_page) {
+    ACL_DEBUG(KERN_WARNING "Couldn't allocate memory for status page!\n");
+    goto fail_status_page;
+  }
+
   res = init_chrdev (aclpci);
   if (res) {
     goto fail_chrdev_init;
@@ -602,8 +740,8 @@ static int MY_PROBE probe(struct pci_dev *dev, const struct pci_device_id *id) {
   // DMA initialization required at driver installation
   // Keep descriptor table in memory
   aclpci_dma_data = &(aclpci->dma_data);
-  aclpci_dma_data->dma_rd_last_id = 255;
-  aclpci_dma_data->dma_wr_last_id = 255;
+  aclpci_dma_data->m_chan[ACL_DMA_CHAN_TO_DEVICE].last_id = ACL_PCIE_DMA_RESET_ID;
+  aclpci_dma_data->m_chan[ACL_DMA_CHAN_FROM_DEVICE].last_id = ACL_PCIE_DMA_RESET_ID;
 
   aclpci_dma_data->desc_table_rd_cpu_virt_addr = (struct dma_desc_table *)dma_zalloc_coherent_local(&dev->dev, sizeof(struct dma_desc_table), &aclpci_dma_data->desc_table_rd_bus_addr, GFP_KERNEL);
   if (!aclpci_dma_data->desc_table_rd_cpu_virt_addr) {
@@ -637,6 +775,9 @@ fail_enable:
   aclpci_devices[MINOR(aclpci->cdev_num)] = 0;
 
 fail_chrdev_init:
+  free_page ((unsigned long)aclpci->status_page);
+
+fail_status_page:
   kfree (aclpci->buffer);
 
 fail_kmalloc:
@@ -752,6 +893,7 @@ static void MY_EXIT remove(struct pci_dev *dev) {
   pci_disable_device(dev);
   pci_release_regions(dev);
 
+  free_page ((unsigned long)aclpci->status_page);
   kfree (aclpci->buffer);
   kfree (aclpci);
 }
@@ -780,11 +922,16 @@ static int __init aclpci_init(void) {
   }
   aclpci_major = MAJOR(dev);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+  aclpci_class = class_create(DRIVER_NAME);
+#else
   aclpci_class = class_create(THIS_MODULE, DRIVER_NAME);
+#endif
   if (IS_ERR(aclpci_class)) {
     printk(KERN_ERR "aclpci: can't create class\n");
     goto err_unchr;
   }
+  aclpci_class->dev_groups = aclpci_groups;
 
   /* register this driver with the PCI bus driver */
   ACL_DEBUG (KERN_DEBUG "pci_register_driver");
@@ -64,6 +64,20 @@
 #include <linux/pci.h>
 #include <linux/uaccess.h>
 #include <linux/sched.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+
+/* io_uring passthrough commands */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#  define ACL_URING_CMD 1
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#    include <linux/io_uring/cmd.h>
+#  else
+#    include <linux/io_uring.h>
+#  endif
+#else
+#  define ACL_URING_CMD 0
+#endif
 
 
 /* includes from opencl/include/pcie */
@@ -119,6 +133,14 @@ do { \
    } \
 } while (0)
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#  define aclpci_mmap_read_lock(mm)   mmap_read_lock(mm)
+#  define aclpci_mmap_read_unlock(mm) mmap_read_unlock(mm)
+#else
+#  define aclpci_mmap_read_lock(mm)   down_read(&(mm)->mmap_sem)
+#  define aclpci_mmap_read_unlock(mm) up_read(&(mm)->mmap_sem)
+#endif
+
 
 
 /* Maximum size of driver buffer (allocated with kalloc()).
@@ -127,6 +149,23 @@ do { \
 static const size_t BUF_SIZE = PAGE_SIZE;
 
 
+/* Global memory transfer calibration. Transfers of ACL_CALIB_MIN_SIZE
+ * bytes and up, doubling each time, are timed with each method. */
+#define ACL_CALIB_MIN_SIZE  1024
+#define ACL_CALIB_SIZES     11
+#define ACL_CALIB_MAX_SIZE  ((size_t)ACL_CALIB_MIN_SIZE << (ACL_CALIB_SIZES - 1))
+#define ACL_CALIB_PIO       0     /* memory window */
+#define ACL_CALIB_BOUNCE    1     /* DMA through the bounce pool */
+#define ACL_CALIB_PINNED    2     /* DMA from pinned user pages */
+#define ACL_CALIB_METHODS   3
+
+/* Smallest global memory transfer that is DMA'd, until calibrated */
+#define ACL_DMA_MIN_DEFAULT 1024
+
+/* Number of ACLPCI_EVENT_* values */
+#define ACLPCI_NUM_EVENTS   2
+
+
 /* Device data used by this driver. */
 struct aclpci_dev {
   /* the kernel pci device data structure */
@@ -195,9 +234,34 @@ struct aclpci_dev {
   u8 irq_pin;
   u8 irq_line;
 
+  /* Woken up when a DMA transfer or a kernel is done */
   wait_queue_head_t wait_q;
   atomic_t status;
   spinlock_t lock;
+
+  /* eventfds signalled instead of sending signal_number, by ACLPCI_EVENT_*.
+   * NULL if not registered. Protected by event_lock. */
+  struct eventfd_ctx *eventfd[ACLPCI_NUM_EVENTS];
+  spinlock_t event_lock;
+
+  /* A kernel done interrupt came in and wasn't acknowledged with
+   * ACLPCI_CMD_ENABLE_KERNEL_IRQ yet */
+  int kernel_irq_pending;
+
+  /* Page user space can mmap() to poll completions without a syscall. One
+   * page, allocated at probe and reset on open. See struct acl_status_page. */
+  struct acl_status_page *status_page;
+
+  /* Global memory transfer thresholds, indexed by 'reading'. Transfers of
+   * at least dma_min bytes are DMA'd, and DMA transfers of at least
+   * dma_pin_min bytes pin the user's pages instead of using the bounce
+   * pool. Defaults until set by ACLPCI_CMD_CALIBRATE_DMA or through sysfs. */
+  size_t dma_min[2];
+  size_t dma_pin_min[2];
+
+  /* Calibration results: time in ns of a transfer, by method, direction
+   * and size. 0 if not measured. */
+  u64 calib_ns[ACL_CALIB_METHODS][2][ACL_CALIB_SIZES];
 };
 
 
@@ -206,6 +270,18 @@ int aclpci_open(struct inode *inode, struct file *file);
 int aclpci_close(struct inode *inode, struct file *file);
 ssize_t aclpci_read(struct file *file, char __user *buf, size_t count, loff_t *pos);
 ssize_t aclpci_write(struct file *file, const char __user *buf, size_t count, loff_t *pos);
+int aclpci_mmap(struct file *file, struct vm_area_struct *vma);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+__poll_t aclpci_poll(struct file *file, poll_table *wait);
+#else
+unsigned int aclpci_poll(struct file *file, poll_table *wait);
+#endif
+#if ACL_URING_CMD
+int aclpci_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
+void aclpci_uring_complete (void *uring_cmd, ssize_t res);
+void aclpci_init_thresholds (struct aclpci_dev *aclpci);
+int aclpci_calibrate (struct aclpci_dev *aclpci, void *dev_addr);
 void* aclpci_get_checked_addr (int bar_id, void *device_addr, size_t count,
                                struct aclpci_dev *aclpci, ssize_t *errno, int print_error_msg);
 
@@ -214,21 +290,44 @@ void load_signal_info (struct aclpci_dev *aclpci);
 int init_irq (struct pci_dev *dev, void *dev_id);
 void release_irq (struct pci_dev *dev, void *aclpci);
 void unmask_kernel_irq(struct aclpci_dev *aclpci);
+int aclpci_set_eventfd (struct aclpci_dev *aclpci, unsigned long event, int fd);
+int aclpci_signal_eventfd (struct aclpci_dev *aclpci, unsigned int event);
 void mask_kernel_irq(struct aclpci_dev *aclpci);
 
 /* aclpci_dma.c functions */
+void aclpci_dma_open(struct aclpci_dev *aclpci);
+void aclpci_dma_close(struct aclpci_dev *aclpci);
 void aclpci_dma_init(struct aclpci_dev *aclpci);
 void aclpci_dma_finish(struct aclpci_dev *aclpci);
 void aclpci_dma_stop(struct aclpci_dev *aclpci);
 int aclpci_dma_get_idle_status(struct aclpci_dev *aclpci);
-ssize_t aclpci_dma_rw (struct aclpci_dev *aclpci, void *dev_addr, void __user* use_addr, ssize_t len, int reading);
-irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci);
+int aclpci_dma_set_polling(struct aclpci_dev *aclpci, int polling);
+void aclpci_dma_set_sync(struct aclpci_dev *aclpci, unsigned int timeout_ms);
+int aclpci_dma_poll(struct aclpci_dev *aclpci);
+int aclpci_dma_wait_idle(struct aclpci_dev *aclpci);
+u64 aclpci_dma_get_submitted_id(struct aclpci_dev *aclpci);
+u64 aclpci_dma_get_completed_id(struct aclpci_dev *aclpci);
+int aclpci_dma_register_region(struct aclpci_dev *aclpci, void __user *addr, size_t len, u32 *handle);
+int aclpci_dma_unregister_region(struct aclpci_dev *aclpci, u32 handle);
+int aclpci_dma_alloc_buffer(struct aclpci_dev *aclpci, size_t len, u32 *handle);
+int aclpci_dma_free_buffer(struct aclpci_dev *aclpci, u32 handle);
+int aclpci_dma_mmap(struct aclpci_dev *aclpci, struct vm_area_struct *vma);
+ssize_t aclpci_dma_rw (struct aclpci_dev *aclpci, void *dev_addr, void __user* use_addr, ssize_t len, int reading, u64 *sync_id);
+int aclpci_dma_wait_sync (struct aclpci_dev *aclpci, int reading, u64 id);
+ssize_t aclpci_dma_rw_sync (struct aclpci_dev *aclpci, void *dev_addr, void __user* user_addr, ssize_t len, int reading);
+ssize_t aclpci_dma_rw_vector (struct aclpci_dev *aclpci, struct acl_dma_segment __user *segs, size_t count, int reading, u64 *sync_id);
+int aclpci_dma_rw_uring (struct aclpci_dev *aclpci, void *dev_addr, void __user* user_addr, ssize_t len, int reading, void *uring_cmd);
+irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci, unsigned int dma_update);
+irqreturn_t aclpci_dma_irq_thread (struct aclpci_dev *aclpci);
 
 /* aclpci_cmd.c functions */
 void retrain_gen2 (struct aclpci_dev *aclpci);
-ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci, struct acl_cmd kcmd, size_t count);
-int aclpci_get_user_pages(struct task_struct *target_task, unsigned long start_page, size_t num_pages, struct page **p);
-void aclpci_release_user_pages(struct task_struct *target_task, struct page **p, size_t num_pages);
+ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci, struct acl_cmd kcmd, size_t count, u64 *sync_id);
+int aclpci_get_user_pages(struct task_struct *target_task, unsigned long start_page, size_t num_pages, struct page **p, int limit);
+void aclpci_release_user_pages(struct task_struct *target_task, struct page **p, size_t num_pages, int dirty);
+void aclpci_release_user_extents(struct task_struct *target_task, struct dma_extent *e, size_t num_extents, int dirty);
+int aclpci_charge_pinned(struct task_struct *target_task, struct mm_struct *mm, size_t num_pages);
+void aclpci_account_pinned(struct mm_struct *mm, long num_pages);
 
 /* aclpci_pr.c functions */
 int aclpci_pr (struct aclpci_dev *aclpci, void __user* core_bitstream, ssize_t len, int __user* pll_config_str);
@@ -72,10 +72,11 @@ void disable_aer_on_upstream_dev(struct aclpci_dev *aclpci);
 void restore_aer_on_upstream_dev(struct aclpci_dev *aclpci);
 
 
-/* Execute special command */
+/* Execute special command. A vectored DMA in sync mode stores the id of
+ * its last transfer in sync_id, for the caller to wait on. */
 ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci, 
                          struct acl_cmd kcmd, 
-                         size_t count) {
+                         size_t count, u64 *sync_id) {
   ssize_t result = 0;
   char buf[BUF_SIZE] = {0};
   size_t bytes_copy; //add by pxx
@@ -106,22 +107,98 @@ ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci,
     break;
   }
 
-  case ACLPCI_CMD_PIN_USER_ADDR:
-//    result = aclpci_pin_user_addr (kcmd.user_addr, count);
+  case ACLPCI_CMD_PIN_USER_ADDR: {
+    u32 handle;
+    result = aclpci_dma_register_region (aclpci, kcmd.user_addr, count, &handle);
+    if (result == 0) {
+      result = copy_to_user ( kcmd.device_addr, &handle, sizeof(handle) );
+      if (result != 0) {
+        aclpci_dma_unregister_region (aclpci, handle);
+      }
+    }
     break;
+  }
 
-  case ACLPCI_CMD_UNPIN_USER_ADDR:
-//    result = aclpci_unpin_user_addr (kcmd.user_addr, count);
+  case ACLPCI_CMD_UNPIN_USER_ADDR: {
+    u32 handle;
+    result = copy_from_user ( &handle, kcmd.device_addr, sizeof(handle) );
+    if (result == 0) {
+      result = aclpci_dma_unregister_region (aclpci, handle);
+    }
     break;
+  }
     
+  case ACLPCI_CMD_ALLOC_DMA_BUFFER: {
+    u32 handle;
+    result = aclpci_dma_alloc_buffer (aclpci, count, &handle);
+    if (result == 0) {
+      result = copy_to_user ( kcmd.device_addr, &handle, sizeof(handle) );
+      if (result != 0) {
+        aclpci_dma_free_buffer (aclpci, handle);
+      }
+    }
+    break;
+  }
+
+  case ACLPCI_CMD_FREE_DMA_BUFFER: {
+    u32 handle;
+    result = copy_from_user ( &handle, kcmd.device_addr, sizeof(handle) );
+    if (result == 0) {
+      result = aclpci_dma_free_buffer (aclpci, handle);
+    }
+    break;
+  }
+
   case ACLPCI_CMD_GET_DMA_IDLE_STATUS: {
     u32 idle = aclpci_dma_get_idle_status(aclpci);
     result = copy_to_user ( kcmd.user_addr, &idle, sizeof(idle) );
     break;
   }
 
+  case ACLPCI_CMD_GET_DMA_SUBMITTED_ID: {
+    u64 id = aclpci_dma_get_submitted_id(aclpci);
+    result = copy_to_user ( kcmd.user_addr, &id, sizeof(id) );
+    break;
+  }
+
+  case ACLPCI_CMD_GET_DMA_COMPLETED_ID: {
+    u64 id = aclpci_dma_get_completed_id(aclpci);
+    result = copy_to_user ( kcmd.user_addr, &id, sizeof(id) );
+    break;
+  }
+
   case ACLPCI_CMD_DMA_UPDATE: {
-    //aclpci_dma_update(aclpci, 0);
+    result = aclpci_dma_poll(aclpci);
+    break;
+  }
+
+  case ACLPCI_CMD_SET_DMA_POLLING: {
+    u32 polling;
+    result = copy_from_user ( &polling, kcmd.user_addr, sizeof(polling) );
+    if (result == 0) {
+      result = aclpci_dma_set_polling(aclpci, polling != 0);
+    }
+    break;
+  }
+
+  case ACLPCI_CMD_SET_DMA_SYNC: {
+    u32 timeout_ms;
+    result = copy_from_user ( &timeout_ms, kcmd.user_addr, sizeof(timeout_ms) );
+    if (result == 0) {
+      aclpci_dma_set_sync(aclpci, timeout_ms);
+    }
+    break;
+  }
+
+  case ACLPCI_CMD_CALIBRATE_DMA: {
+    result = aclpci_calibrate(aclpci, kcmd.device_addr);
+    break;
+  }
+
+  case ACLPCI_CMD_DMA_WRITEV:
+  case ACLPCI_CMD_DMA_READV: {
+    result = aclpci_dma_rw_vector(aclpci, (struct acl_dma_segment __user *)kcmd.user_addr,
+                                  kcmd.size, kcmd.command == ACLPCI_CMD_DMA_READV, sync_id);
     break;
   }
 
@@ -150,10 +227,21 @@ ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci,
   }
  
   case ACLPCI_CMD_ENABLE_KERNEL_IRQ: {
+    aclpci->kernel_irq_pending = 0;
+    WRITE_ONCE(aclpci->status_page->kernel_irq_pending, 0);
     unmask_kernel_irq(aclpci);
     break;
   }
 
+  case ACLPCI_CMD_SET_EVENTFD: {
+    int fd;
+    result = copy_from_user ( &fd, kcmd.user_addr, sizeof(fd) );
+    if (result == 0) {
+      result = aclpci_set_eventfd(aclpci, (unsigned long)kcmd.device_addr, fd);
+    }
+    break;
+  }
+
  
   case ACLPCI_CMD_DO_PR: {
     result = aclpci_pr (aclpci, kcmd.user_addr, count, kcmd.device_addr);
@@ -230,10 +318,26 @@ ssize_t aclpci_exec_cmd (struct aclpci_dev *aclpci,
 /* Pinning user pages.
  * 
  * Taken from <kernel code>/drivers/infiniband/hw/ipath/ipath_user_pages.c
+ *
+ * Pages stay pinned for as long as a DMA window or the pinned-page cache
+ * needs them, so they are pinned with FOLL_LONGTERM. From the user's own
+ * context that is pin_user_pages_fast(), which only takes the mmap lock to
+ * fault pages in. The DMA workqueue has no mm and pins remotely under the
+ * read lock. Unpinning takes no lock, and only pages the device wrote to
+ * are dirtied.
  */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#  define ACL_PIN_USER_PAGES 1
+#else
+#  define ACL_PIN_USER_PAGES 0
+#endif
+
 static void __aclpci_release_user_pages(struct page **p, size_t num_pages,
 				   int dirty)
 {
+#if ACL_PIN_USER_PAGES
+	unpin_user_pages_dirty_lock(p, num_pages, dirty);
+#else
 	size_t i;
 
 	for (i = 0; i < num_pages; i++) {
@@ -242,51 +346,118 @@ static void __aclpci_release_user_pages(struct page **p, size_t num_pages,
       }
 		put_page(p[i]);
 	}
+#endif
+}
+
+/* Pinned pages are counted in pinned_vm, like RDMA does */
+void aclpci_account_pinned(struct mm_struct *mm, long num_pages)
+{
+	if (mm == NULL) {
+		return;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	atomic64_add(num_pages, &mm->pinned_vm);
+#else
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm += num_pages;
+	up_write(&mm->mmap_sem);
+#endif
+}
+
+/* Charge num_pages to pinned_vm before pinning them. Fails if that would
+ * take the mm over the pinning task's RLIMIT_MEMLOCK, unless the task has
+ * CAP_IPC_LOCK. The task is checked rather than current, since the DMA
+ * workqueue pins on the user's behalf. */
+int aclpci_charge_pinned(struct task_struct *target_task, struct mm_struct *mm, size_t num_pages)
+{
+	unsigned long limit = task_rlimit(target_task, RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	unsigned long locked;
+	int ret = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	locked = atomic64_add_return(num_pages, &mm->pinned_vm);
+	if (locked > limit && !has_capability_noaudit(target_task, CAP_IPC_LOCK)) {
+		atomic64_sub(num_pages, &mm->pinned_vm);
+		ret = -ENOMEM;
+	}
+#else
+	down_write(&mm->mmap_sem);
+	locked = mm->pinned_vm + num_pages;
+	if (locked > limit && !has_capability_noaudit(target_task, CAP_IPC_LOCK)) {
+		ret = -ENOMEM;
+	} else {
+		mm->pinned_vm = locked;
+	}
+	up_write(&mm->mmap_sem);
+#endif
+	return ret;
 }
 
-/* call with target_task->mm->mmap_sem held */
 static int __aclpci_get_user_pages(struct task_struct *target_task, unsigned long start_page, size_t num_pages,
-			struct page **p, struct vm_area_struct **vma)
+			struct page **p, int limit)
 {
+	struct mm_struct *mm = target_task->mm;
+	unsigned long addr;
 	size_t got;
-	int ret;
+	int ret = 0;
+
+	if (mm == NULL) {
+		return -EFAULT;
+	}
+	if (!limit) {
+		aclpci_account_pinned(mm, num_pages);
+	} else if (aclpci_charge_pinned(target_task, mm, num_pages) != 0) {
+		ACL_DEBUG (KERN_DEBUG "Pinning %zu pages would exceed RLIMIT_MEMLOCK", num_pages);
+		return -ENOMEM;
+	}
 
 	for (got = 0; got < num_pages; got += ret) {
+		addr = start_page + got * PAGE_SIZE;
+#if ACL_PIN_USER_PAGES
+		if (current->mm == mm) {
+			ret = pin_user_pages_fast(addr, num_pages - got, FOLL_WRITE|FOLL_LONGTERM, p + got);
+		} else {
+			aclpci_mmap_read_lock(mm);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+			ret = pin_user_pages_remote(mm, addr, num_pages - got, FOLL_WRITE|FOLL_LONGTERM, p + got, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+			ret = pin_user_pages_remote(mm, addr, num_pages - got, FOLL_WRITE|FOLL_LONGTERM, p + got, NULL, NULL);
+#else
+			ret = pin_user_pages_remote(target_task, mm, addr, num_pages - got, FOLL_WRITE|FOLL_LONGTERM, p + got, NULL, NULL);
+#endif
+			aclpci_mmap_read_unlock(mm);
+		}
+#else
+		aclpci_mmap_read_lock(mm);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
-   ret = get_user_pages_remote(target_task, target_task->mm,
-             start_page + got * PAGE_SIZE,
-             num_pages - got,
-             FOLL_WRITE|FOLL_FORCE,
-             p + got,
-             vma, NULL);
+		ret = get_user_pages_remote(target_task, mm, addr, num_pages - got,
+		                            FOLL_WRITE, p + got, NULL, NULL);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
-   ret = get_user_pages_remote(target_task, target_task->mm,
-             start_page + got * PAGE_SIZE,
-             num_pages - got,
-             FOLL_WRITE|FOLL_FORCE,
-             p + got,
-             vma);
+		ret = get_user_pages_remote(target_task, mm, addr, num_pages - got,
+		                            FOLL_WRITE, p + got, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+		ret = get_user_pages_remote(target_task, mm, addr, num_pages - got, 1, 0,
+		                            p + got, NULL);
 #else
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
-   ret = get_user_pages_remote(target_task, target_task->mm,
-#else
-   ret = get_user_pages(target_task, target_task->mm,
+		ret = get_user_pages(target_task, mm, addr, num_pages - got, 1, 0,
+		                     p + got, NULL);
 #endif
-             start_page + got * PAGE_SIZE,
-             num_pages - got, 1, 1,
-             p + got, vma);
+		aclpci_mmap_read_unlock(mm);
 #endif
-		if (ret < 0)
+		if (ret <= 0) {
+			if (ret == 0) {
+				ret = -EFAULT;
+			}
 			goto bail_release;
+		}
 	}
 
-	target_task->mm->locked_vm += num_pages;
-
 	ret = 0;
 	goto bail;
 
 bail_release:
 	__aclpci_release_user_pages(p, got, 0);
+	aclpci_account_pinned(mm, -(long)num_pages);
 bail:
 	return ret;
 }
@@ -297,31 +468,59 @@ bail:
  * @start_page: the start page
  * @num_pages: the number of pages
  * @p: the output page structures
+ * @limit: nonzero to fail with -ENOMEM past RLIMIT_MEMLOCK. Pages are
+ *         counted in pinned_vm either way, but only pins that outlive a
+ *         transfer are held to the limit.
  *
  * This function takes a given start page (page aligned user virtual
  * address) and pins it and the following specified number of pages.
  */
 int aclpci_get_user_pages(struct task_struct *target_task, unsigned long start_page, size_t num_pages,
-			 struct page **p)
+			 struct page **p, int limit)
 {
-	int ret;
+	return __aclpci_get_user_pages(target_task, start_page, num_pages, p, limit);
+}
 
-	down_write(&target_task->mm->mmap_sem);
-	ret = __aclpci_get_user_pages(target_task, start_page, num_pages, p, NULL);
-	up_write(&target_task->mm->mmap_sem);
+/**
+ * aclpci_release_user_pages - unpin pages from aclpci_get_user_pages()
+ * @dirty: nonzero if the device wrote to the pages
+ */
+void aclpci_release_user_pages(struct task_struct *target_task, struct page **p, size_t num_pages, int dirty)
+{
+	__aclpci_release_user_pages(p, num_pages, dirty);
 
-	return ret;
+	aclpci_account_pinned(target_task->mm, -(long)num_pages);
 }
 
-void aclpci_release_user_pages(struct task_struct *target_task, struct page **p, size_t num_pages)
+/**
+ * aclpci_release_user_extents - unpin pages collected into extents
+ * @e: the extents
+ * @num_extents: the number of extents
+ * @dirty: nonzero if the device wrote to the pages
+ *
+ * Same as aclpci_release_user_pages() for every page of every extent.
+ */
+void aclpci_release_user_extents(struct task_struct *target_task, struct dma_extent *e, size_t num_extents, int dirty)
 {
-	down_write(&target_task->mm->mmap_sem);
-
-	__aclpci_release_user_pages(p, num_pages, 1);
+	size_t i, num_pages = 0;
+#if !ACL_PIN_USER_PAGES || LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	size_t j;
+	struct page *p;
+#endif
 
-	target_task->mm->locked_vm -= num_pages;
+	for (i = 0; i < num_extents; i++) {
+#if ACL_PIN_USER_PAGES && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		unpin_user_page_range_dirty_lock(e[i].page, e[i].num_pages, dirty);
+#else
+		for (j = 0; j < e[i].num_pages; j++) {
+			p = pfn_to_page(page_to_pfn(e[i].page) + j);
+			__aclpci_release_user_pages(&p, 1, dirty);
+		}
+#endif
+		num_pages += e[i].num_pages;
+	}
 
-	up_write(&target_task->mm->mmap_sem);
+	aclpci_account_pinned(target_task->mm, -(long)num_pages);
 }
 
 void store_pci_speed(struct aclpci_dev *aclpci, u16 speed) {
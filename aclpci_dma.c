@@ -50,15 +50,26 @@
  *  2. Setup descriptor table entries. The table has 128 entries, each entry has
  *     64 bit dma host address, 64 bit device address, size of transfer in dwords
  *     and the id number of the transfer.
- *  3. Send address descriptor table dma host address, device descriptor table
- *     FIFO address, size of the descriptor table and last transfer id to DMA
- *     controller
+ *  3. Send the last transfer id to the DMA controller. The first time in a
+ *     session, the descriptor table dma host address, device descriptor table
+ *     FIFO address and size of the descriptor table are sent before it. The
+ *     table is then used as a ring, and descriptors are appended after the
+ *     previous last id, wrapping around after entry 127.
  *  4. Go to step 2 if have not transfered all currently pinned memory yet.
  *  5. Go to step 1 if need to pin more memory.
  *
  * DMA controller writes back the last transfer id status bit of the descriptor table
  * back into the host memory. At the same time, it signals an MSI interrupt
  *
+ * While the controller works on one batch of descriptors, the next batch is
+ * built (and its memory pinned) in the following half of the ring. The
+ * bottom half then only has to write the last pointer to start it.
+ *
+ * The controller has independent host-to-device (RD) and device-to-host (WR)
+ * halves. Each half is driven by its own channel (struct aclpci_dma_chan) with
+ * its own request queue, pinned memory and work item, so an upload and a
+ * download can be in flight at the same time.
+ *
  * Due to hardware restrictions, DMA can only do minimum transfer of 32-bits.
  * The DMA driver logic assumed that MMD will not ask for transfers not divisible by 4
  */
@@ -87,17 +98,52 @@
 
 #if USE_DMA
 
-/* Map/Unmap pages for DMA transfer.
- * All docs say I need to do it but unmapping pages after
- * reading clears their content. */
-
-#ifdef ACL_BIG_ENDIAN
-#  define MAP_UNMAP_PAGES 1
-#else
-#  define MAP_UNMAP_PAGES 0
-#endif
-
-#define DEBUG_UNLOCK_PAGES 0
+/* Largest number of whole pages a single descriptor can carry */
+#define ACL_PCIE_DMA_DESC_MAX_PAGES ((ACL_PCIE_DMA_DESC_MAX_DWORDS * 4) / PAGE_SIZE)
+
+/* Most descriptors appended to the ring at once. The ring holds two
+ * batches: the one the engine is working on and the next one, built in
+ * the meantime. */
+#define ACL_PCIE_DMA_RING_MAX_BATCH (ACL_PCIE_DMA_TABLE_SIZE / 2)
+
+/* User pages are pinned this many at a time. Enough for a whole DMA
+ * window of the default minimum size, so pinning one takes a single call.
+ * Larger windows take several, and their extent arrays are grown with
+ * krealloc instead of coming from the window pool. */
+#define ACL_PCIE_DMA_PIN_BATCH (ACL_PCIE_DMA_PAGES_LOCKED + ACL_PCIE_DMA_TABLE_SIZE)
+
+/* Where finished descriptor batches get refilled. The IRQ thread runs at
+ * SCHED_FIFO priority, so unlike the workqueue it isn't delayed by busy
+ * CPUs. Can be changed at any time. */
+static int dma_irq_thread = 1;
+module_param(dma_irq_thread, int, 0644);
+MODULE_PARM_DESC(dma_irq_thread, "Refill DMA descriptors from the IRQ thread (1) or from the workqueue (0)");
+
+/* Polling mode: how long poll_until() spins on the descriptor status
+ * after the last progress, and then how long it sleeps between checks. */
+static unsigned int dma_poll_spin_us = 50;
+module_param(dma_poll_spin_us, uint, 0644);
+MODULE_PARM_DESC(dma_poll_spin_us, "Polling mode: time to busy-wait for a DMA batch before sleeping, in usec");
+
+static unsigned int dma_poll_sleep_us = 20;
+module_param(dma_poll_sleep_us, uint, 0644);
+MODULE_PARM_DESC(dma_poll_sleep_us, "Polling mode: minimum sleep between DMA status checks once done spinning, in usec");
+
+/* Bounds of the pin-ahead window, in pages. Each channel picks its window
+ * size in between from the measured pin and transfer costs, see
+ * adapt_window(). Setting both to the same value fixes the size. Can be
+ * changed at any time. */
+static unsigned int dma_win_min_pages = ACL_PCIE_DMA_PAGES_LOCKED;
+module_param(dma_win_min_pages, uint, 0644);
+MODULE_PARM_DESC(dma_win_min_pages, "Smallest DMA pin-ahead window, in pages");
+
+static unsigned int dma_win_max_pages = 4096;
+module_param(dma_win_max_pages, uint, 0644);
+MODULE_PARM_DESC(dma_win_max_pages, "Largest DMA pin-ahead window, in pages. Also bounded by half of RLIMIT_MEMLOCK");
+
+/* Pins and batches of fewer pages than this aren't used to measure costs.
+ * Their time is mostly per-call overhead. */
+#define ACL_PCIE_DMA_MIN_SAMPLE_PAGES ACL_PCIE_DMA_RING_MAX_BATCH
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
 void wq_func_dma_update(void *data);
@@ -107,9 +153,26 @@ void wq_func_dma_update(struct work_struct *pwork);
 
 /* Forward declarations */
 static int set_desc_table_header(struct dma_desc_header *header);
-int read_write (struct aclpci_dev* aclpci, void* src, void *dst, size_t bytes, int reading);
-void unlock_dma_buffer (struct aclpci_dev *aclpci, struct dma_t *dma);
-void unlock_all_dma (struct aclpci_dev *aclpci);
+int read_write (struct aclpci_dev* aclpci, void* src, void *dst, size_t bytes, int reading,
+                struct dma_region *host_buf, int notify, u64 *id);
+static void start_request (struct aclpci_dev *aclpci, struct dma_request *req);
+static int queue_requests (struct aclpci_dev *aclpci, struct dma_request *reqs, unsigned int n, int reading, u64 *id);
+static int build_batch (struct aclpci_dev *aclpci, int reading);
+void unlock_dma_buffer (struct aclpci_dev *aclpci, int reading, struct dma_t *dma);
+void unlock_all_dma (struct aclpci_dev *aclpci, int reading);
+int aclpci_dma_update (struct aclpci_dev *aclpci, int reading, int forced);
+static void release_region (struct aclpci_dev *aclpci, struct dma_region *r);
+static void free_dma_buffer (struct aclpci_dev *aclpci, struct dma_region *r);
+static void pool_put_request (struct aclpci_dma *d, struct dma_request *req);
+static void update_status_page (struct aclpci_dev *aclpci, u64 done_id, long status);
+static u64 chan_completed_id_locked(struct aclpci_dev *aclpci, int reading);
+static u64 chan_completed_id(struct aclpci_dev *aclpci, int reading);
+static int poll_until (struct aclpci_dev *aclpci, int reading, u64 id,
+                       unsigned int timeout_ms, int drop_sem);
+static void unpin_work_func (struct work_struct *work);
+#if ACL_DMA_PIN_CACHE
+static void cache_shrink (struct aclpci_dma *d, unsigned long max_pages);
+#endif
 
 
 void *get_dma_desc_offset(struct aclpci_dev *aclpci) {
@@ -117,9 +180,14 @@ void *get_dma_desc_offset(struct aclpci_dev *aclpci) {
 }
 
 
+/* Channel that handles transfers in the given direction */
+static inline struct aclpci_dma_chan *get_chan (struct aclpci_dev *aclpci, int reading) {
+  return &(aclpci->dma_data.m_chan[reading ? ACL_DMA_CHAN_FROM_DEVICE : ACL_DMA_CHAN_TO_DEVICE]);
+}
+
+
 int is_idle (struct aclpci_dev *aclpci) {
-  struct aclpci_dma *d = &(aclpci->dma_data);
-  return d->m_idle;
+  return aclpci_dma_get_idle_status(aclpci);
 }
 
 
@@ -131,236 +199,2169 @@ void* compute_address (void* base, unsigned long offset)
 }
 
 
+/* Returns 1 if the descriptor with the channel's last id has been processed.
+ * Returns 0 if it hasn't or if nothing was submitted. */
+int aclpci_dma_chan_done (struct aclpci_dma_chan *c) {
+  if (c->last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES) {
+    return c->desc_table->header.flags[c->last_id] != 0;
+  }
+  return 0;
+}
+
+
+/* Allocate and map a bounce buffer as a single extent. Transfers just don't
+ * use it if this fails. */
+static void alloc_bounce_buffer (struct aclpci_dma *d, struct dma_region *r,
+                                 struct dma_extent *e, size_t len) {
+
+  unsigned int order = get_order(len);
+
+  memset (r, 0, sizeof(struct dma_region));
+  e->page = alloc_pages (GFP_KERNEL | __GFP_NOWARN, order);
+  if (e->page == NULL) {
+    ACL_DEBUG (KERN_WARNING "Couldn't allocate DMA bounce buffer");
+    return;
+  }
+  e->num_pages = 1 << order;
+  e->dma_addr = dma_map_page (&d->m_pci_dev->dev, e->page, 0, PAGE_SIZE << order, DMA_BIDIRECTIONAL);
+  if (dma_mapping_error (&d->m_pci_dev->dev, e->dma_addr)) {
+    ACL_DEBUG (KERN_WARNING "Couldn't map DMA bounce buffer");
+    __free_pages (e->page, order);
+    return;
+  }
+
+  r->ptr = page_address (e->page);
+  r->len = len;
+  r->dir = DMA_BIDIRECTIONAL;
+  r->extents = e;
+  r->num_extents = 1;
+  r->num_pages = e->num_pages;
+}
+
+
+/* Set up the user buffers: registered regions, driver-allocated buffers
+ * and the pinned-page cache. They belong to the open file rather than to
+ * the interrupt, so they stay valid across aclpci_dma_finish() and
+ * aclpci_dma_init() when the FPGA is reprogrammed. */
+void aclpci_dma_open(struct aclpci_dev *aclpci) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+
+  d->m_aclpci = aclpci;
+  mutex_init(&d->m_regions_lock);
+  memset( d->m_regions, 0, sizeof(d->m_regions) );
+  INIT_LIST_HEAD(&d->m_unpin_list);
+  spin_lock_init(&d->m_unpin_lock);
+  INIT_WORK(&d->m_unpin_work, unpin_work_func);
+#if ACL_DMA_PIN_CACHE
+  d->m_cache_tree = RB_ROOT_CACHED;
+  INIT_LIST_HEAD(&d->m_cache_lru);
+  INIT_LIST_HEAD(&d->m_cache_dead);
+  d->m_cache_pages = 0;
+  spin_lock_init(&d->m_cache_lock);
+#endif
+}
+
+
+/* Release the user buffers the user didn't free. Called after
+ * aclpci_dma_finish() on the last close, so nothing is transferring, and
+ * the file is going away so nothing is mmap()ed. */
+void aclpci_dma_close(struct aclpci_dev *aclpci) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region tmp;
+  int i;
+
+  for (i = 0; i < ACL_PCIE_DMA_MAX_REGIONS; i++) {
+    if (d->m_regions[i].extents != NULL) {
+      tmp = d->m_regions[i];
+      memset (&(d->m_regions[i]), 0, sizeof(struct dma_region));
+      release_region (aclpci, &tmp);
+    }
+  }
+
+#if ACL_DMA_PIN_CACHE
+  cache_shrink (d, 0);
+#endif
+  // With the cache empty, the notifiers can't queue any more work
+  flush_work(&d->m_unpin_work);
+}
+
+
 /* Init DMA engine. Should be done at device load time */
 void aclpci_dma_init(struct aclpci_dev *aclpci) {
 
   struct aclpci_dma *d = &(aclpci->dma_data);
-  memset( &d->m_active_mem, 0, sizeof(struct pinned_mem) );
-  d->m_idle=1;
+  struct aclpci_dma_chan *c;
+  unsigned long flags;
+  int reading, i;
 
   d->m_aclpci = aclpci;
   d->m_pci_dev = aclpci->pci_dev;
+  // Let the IOMMU merge pages into segments longer than the PCI default of
+  // 64K. Descriptors are cut to size when the batch is built.
+  dma_set_max_seg_size(&d->m_pci_dev->dev, UINT_MAX);
+  d->m_irq_pending = 0;
+  d->m_polling = 0;
+  d->m_sync_ms = 0;
+
+  spin_lock_init(&d->m_requests_lock);
+  d->m_last_submitted_id = 0;
+  alloc_bounce_buffer (d, &(d->m_bounce), &(d->m_bounce_extent), ACL_PCIE_DMA_BOUNCE_SIZE);
+  for (i = 0; i < ACL_PCIE_DMA_POOL_BUFS; i++) {
+    alloc_bounce_buffer (d, &(d->m_pool[i]), &(d->m_pool_extent[i]), ACL_PCIE_DMA_POOL_BUF_SIZE);
+  }
+  d->m_pool_busy = 0;
+  d->m_bounce_pending = 0;
+  memset (d->m_pool_pending, 0, sizeof(d->m_pool_pending));
+  for (i = 0; i < ACL_PCIE_DMA_WIN_POOL; i++) {
+    d->m_win_pool[i] = (struct dma_win_buf *)kvmalloc (sizeof(struct dma_win_buf) +
+                                                       ACL_PCIE_DMA_PIN_BATCH * (sizeof(struct dma_extent) + sizeof(struct scatterlist)),
+                                                       GFP_KERNEL);
+    if (d->m_win_pool[i] != NULL) {
+      d->m_win_pool[i]->sgl = (struct scatterlist *)(d->m_win_pool[i]->extents + ACL_PCIE_DMA_PIN_BATCH);
+    }
+  }
+  d->m_win_busy = 0;
 
-  // create a workqueue with a single thread and a work structure
+  // create a workqueue and a work structure per channel. The workqueue
+  // runs both channels' work at the same time.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
   d->my_wq   = create_singlethread_workqueue("aclkmdq");
-  d->my_work = (struct work_struct_t*) kmalloc(sizeof(struct work_struct_t), GFP_KERNEL);
-  if(d->my_work) {
-    d->my_work->data = (void *)aclpci;
+#else
+  d->my_wq   = alloc_workqueue("aclkmdq", WQ_UNBOUND, ACL_DMA_NUM_CHANS);
+#endif
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    memset( &c->m_active_mem, 0, sizeof(struct pinned_mem) );
+    c->m_read = reading;
+    c->m_aclpci = aclpci;
+    c->m_idle = 1;
+    c->last_id = ACL_PCIE_DMA_RESET_ID;
+    c->m_ring_ready = 0;
+    c->m_in_flight = 0;
+    c->m_staged_last_id = ACL_PCIE_DMA_RESET_ID;
+    c->m_failed = 0;
+    mutex_init(&c->m_update_lock);
+    c->m_irq_stamp = 0;
+    c->m_irq_count = c->m_irq_latency_total = c->m_irq_latency_max = 0;
+    c->m_win_pages = dma_win_min_pages;
+    c->m_pin_ns = c->m_drain_ns = 0;
+    c->m_flight_pages = c->m_staged_pages = 0;
+    if (reading) {
+      c->desc_table = d->desc_table_wr_cpu_virt_addr;
+      c->desc_table_bus_addr = d->desc_table_wr_bus_addr;
+    } else {
+      c->desc_table = d->desc_table_rd_cpu_virt_addr;
+      c->desc_table_bus_addr = d->desc_table_rd_bus_addr;
+    }
+    queue_init(&c->m_requests, sizeof(struct dma_request), ACL_PCIE_DMA_MAX_REQUESTS);
+    c->m_pin_pages = (struct page **)kvmalloc_array (ACL_PCIE_DMA_PIN_BATCH, sizeof(struct page *), GFP_KERNEL);
+
+    c->my_work = (struct work_struct_t*) kmalloc(sizeof(struct work_struct_t), GFP_KERNEL);
+    if(c->my_work) {
+      c->my_work->data = (void *)c;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
-    INIT_WORK( &d->my_work->work, wq_func_dma_update, (void *)d->my_work->data);
+      INIT_WORK( &c->my_work->work, wq_func_dma_update, (void *)c->my_work->data);
 #else
-    INIT_WORK( &d->my_work->work, wq_func_dma_update);
+      INIT_WORK( &c->my_work->work, wq_func_dma_update);
 #endif
+    }
   }
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  update_status_page(aclpci, 0, 0);
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
 }
 
 
-void aclpci_dma_finish(struct aclpci_dev *aclpci) {
+/* Drop the transfers that never started, completing their io_uring
+ * commands with -ECANCELED. With the queues empty they count as completed,
+ * so nobody waits on them forever. */
+static void cancel_requests(struct aclpci_dev *aclpci) {
 
   struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c;
+  struct dma_request *req;
+  unsigned long flags;
+  int reading;
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    while (!queue_empty(&c->m_requests)) {
+      req = (struct dma_request *)queue_front(&c->m_requests);
+      pool_put_request(d, req);
+      if (req->uring_cmd != NULL) {
+        aclpci_uring_complete(req->uring_cmd, -ECANCELED);
+      }
+      update_status_page(aclpci, req->id, -ECANCELED);
+      queue_pop(&c->m_requests);
+    }
+  }
+  update_status_page(aclpci, 0, 0);
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
+}
+
 
-  d->dma_wr_last_id = ACL_PCIE_DMA_RESET_ID;
-  d->dma_rd_last_id = ACL_PCIE_DMA_RESET_ID;
+void aclpci_dma_finish(struct aclpci_dev *aclpci) {
 
-  unlock_all_dma(aclpci);
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c;
+  int reading, i;
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    mutex_lock(&c->m_update_lock);
+    c->last_id = ACL_PCIE_DMA_RESET_ID;
+    unlock_all_dma(aclpci, reading);
+    mutex_unlock(&c->m_update_lock);
+
+    if (c->m_irq_count != 0) {
+      ACL_DEBUG (KERN_DEBUG "DMA %s: %llu interrupts, interrupt to refill latency avg %llu ns, max %llu ns (%s)",
+                 reading ? "read" : "write", c->m_irq_count,
+                 div64_u64(c->m_irq_latency_total, c->m_irq_count), c->m_irq_latency_max,
+                 dma_irq_thread ? "IRQ thread" : "workqueue");
+    }
+    ACL_DEBUG (KERN_DEBUG "DMA %s: pin-ahead window %u pages, pin %llu ns/page, transfer %llu ns/page",
+               reading ? "read" : "write", c->m_win_pages, c->m_pin_ns, c->m_drain_ns);
+  }
 
   flush_workqueue(d->my_wq);
   destroy_workqueue(d->my_wq);
-  kfree(d->my_work);
-  d->m_idle = 1;
+  flush_work(&d->m_unpin_work);
 
+  // Queued io_uring commands must get a completion before the queues go
+  cancel_requests(aclpci);
+
+  if (d->m_bounce.extents != NULL) {
+    free_dma_buffer (aclpci, &(d->m_bounce));
+    memset (&(d->m_bounce), 0, sizeof(struct dma_region));
+  }
+  for (i = 0; i < ACL_PCIE_DMA_POOL_BUFS; i++) {
+    if (d->m_pool[i].extents != NULL) {
+      free_dma_buffer (aclpci, &(d->m_pool[i]));
+      memset (&(d->m_pool[i]), 0, sizeof(struct dma_region));
+    }
+  }
+  d->m_pool_busy = 0;
+  d->m_bounce_pending = 0;
+  memset (d->m_pool_pending, 0, sizeof(d->m_pool_pending));
+
+  // Everything pinned is released by now, including the cache
+  for (i = 0; i < ACL_PCIE_DMA_WIN_POOL; i++) {
+    kvfree (d->m_win_pool[i]);
+    d->m_win_pool[i] = NULL;
+  }
+  d->m_win_busy = 0;
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    kfree(c->my_work);
+    c->my_work = NULL;
+    kvfree(c->m_pin_pages);
+    c->m_pin_pages = NULL;
+    c->m_idle = 1;
+    queue_fini(&c->m_requests);
+  }
 }
 
 void aclpci_dma_stop(struct aclpci_dev *aclpci) {
-  int dma_last_id, reading;
-  int dma_update = 0;
-  int timeout = 0;
+  int reading;
+  int dma_update;
+  int timeout;
+  unsigned long flags;
 
   struct aclpci_dma *d = &(aclpci->dma_data);
-  reading = d->m_read;
+  struct aclpci_dma_chan *c;
 
   // Set DMA to idle to tell interrupt handler to stop queueing DMA update.
   // Since the MMD calls dma stop as a read command, there should be nothing that checks
   // DMA idle state until aclpci_dma_stop exits.
-  d->m_idle = 1;
+  // Taking the request lock also keeps the workqueue from starting the next
+  // queued transfer.
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    get_chan(aclpci, reading)->m_idle = 1;
+  }
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
 
   // Flush any pending work on the workqueue.
   // This will request the last DMA request if the queue is not empty.
   flush_workqueue(d->my_wq);
 
-  // Finish the last outstanding DMA request by polling valid bit.
-  // Timeout of ~1s was added in case there is issue with DMA IP, and it's not sending the last valid bit.
-  // This should only happen during board bring-up, if it happens at all.
-  while ((dma_update == 0) && (timeout < ACL_PCIE_DMA_CTRL_C_TIMEOUT)) {
-    if (reading) {
-       if (d->dma_wr_last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES) {
-         dma_last_id = d->dma_wr_last_id;
-         dma_update = (d->desc_table_wr_cpu_virt_addr->header.flags[dma_last_id]);
-       } else {
-         dma_update = 1;
-       }
-     } else {
-       if (d->dma_rd_last_id < ACL_PCIE_DMA_DESC_MAX_ENTRIES) {
-         dma_last_id = d->dma_rd_last_id;
-         dma_update = (d->desc_table_rd_cpu_virt_addr->header.flags[dma_last_id]);
-       } else {
-         dma_update = 1;
-       }
-     }
-
-     msleep(1);
-     timeout += 1;
-  }
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    // Wait for the IRQ thread if it is in the middle of an update
+    mutex_lock(&c->m_update_lock);
+
+    // Finish the last outstanding DMA request by polling valid bit.
+    // Timeout of ~1s was added in case there is issue with DMA IP, and it's not sending the last valid bit.
+    // This should only happen during board bring-up, if it happens at all.
+    dma_update = (c->last_id >= ACL_PCIE_DMA_DESC_MAX_ENTRIES);
+    timeout = 0;
+    while ((dma_update == 0) && (timeout < ACL_PCIE_DMA_CTRL_C_TIMEOUT)) {
+       dma_update = aclpci_dma_chan_done(c);
+       msleep(1);
+       timeout += 1;
+    }
 
-  if (reading) {
-    set_desc_table_header(&d->desc_table_wr_cpu_virt_addr->header);
-  } else {
-    set_desc_table_header(&d->desc_table_rd_cpu_virt_addr->header);
+    set_desc_table_header(&c->desc_table->header);
+    c->last_id = ACL_PCIE_DMA_RESET_ID;
+    // The transfer may have been cut short. Program the ring from scratch
+    // next time, and drop the batch that was waiting for this one.
+    c->m_ring_ready = 0;
+    c->m_in_flight = 0;
+    c->m_staged_last_id = ACL_PCIE_DMA_RESET_ID;
+    c->m_failed = 0;
+
+    // Unpin all memories
+    unlock_all_dma(aclpci, reading);
+    mutex_unlock(&c->m_update_lock);
   }
 
-  d->dma_wr_last_id = ACL_PCIE_DMA_RESET_ID;
-  d->dma_rd_last_id = ACL_PCIE_DMA_RESET_ID;
-
-  // Unpin all memories
-  unlock_all_dma(aclpci);
+  cancel_requests(aclpci);
 }
 
 
 /* Called by main interrupt handler in aclpci.c. By the time we get here,
- * we know it's a DMA interrupt. So only need to do DMA-related stuff. */
-irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci)
+ * we know it's a DMA interrupt. dma_update has bit 'reading' set for each
+ * channel whose last descriptor is done. */
+irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci, unsigned int dma_update)
 {
   // Keep this to not affect aclpci.c.
   // Add in code here for MSI
   struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c;
   struct timespec64 us_end_time;
   long int seconds, useconds;
-  int reading = d->m_read;
+  int reading;
+  irqreturn_t res = IRQ_HANDLED;
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    c = get_chan(aclpci, reading);
+    // In polling mode the status is left for aclpci_dma_poll() to find
+    if (!(dma_update & (1 << reading)) || c->m_idle || d->m_polling) {
+      continue;
+    }
+
+    set_desc_table_header(&c->desc_table->header);
+
+    if (c->m_us_valid == 1) {
+      c->m_us_valid = 0;
+      ktime_get_ts64(&us_end_time);
+      seconds = us_end_time.tv_sec - c->m_us_dma_start_time.tv_sec;
+      useconds = us_end_time.tv_nsec - c->m_us_dma_start_time.tv_nsec;
+      ACL_VERBOSE_DEBUG (KERN_DEBUG "Last %s table transfer measured %06ld nsec :: check seconds %ld should be zero",
+                         reading ? "read" : "write", useconds, seconds);
+    }
 
-  if (d->m_idle) {
-    return IRQ_HANDLED;
+    c->m_irq_stamp = ktime_get_ns();
+    if (dma_irq_thread) {
+      set_bit(reading, &d->m_irq_pending);
+      res = IRQ_WAKE_THREAD;
+    } else {
+      queue_work(d->my_wq, &c->my_work->work);
+    }
   }
 
-  if (reading) {
-    set_desc_table_header(&d->desc_table_wr_cpu_virt_addr->header);
+  return res;
+}
+
+
+/* Threaded half of the DMA interrupt. Refills the channels flagged by
+ * aclpci_dma_service_interrupt() right here, without going through the
+ * workqueue. */
+irqreturn_t aclpci_dma_irq_thread (struct aclpci_dev *aclpci)
+{
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c;
+  int reading;
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    if (!test_and_clear_bit(reading, &d->m_irq_pending)) {
+      continue;
+    }
+    c = get_chan(aclpci, reading);
+    mutex_lock(&c->m_update_lock);
+    // aclpci_dma_stop() may have dropped the transfer in the meantime
+    if (!c->m_idle) {
+      aclpci_dma_update(aclpci, reading, 1);
+    }
+    mutex_unlock(&c->m_update_lock);
+  }
+
+  return IRQ_HANDLED;
+}
+
+
+/* Wait for the transfer with the given id, queued in the given direction,
+ * to finish. Transfers in the other direction don't hold it up. If it
+ * doesn't finish, it is left running, along with everything else. The
+ * caller has to keep the buffer it uses busy until it is done, see
+ * m_bounce_pending. */
+static int wait_for_request (struct aclpci_dev *aclpci, int reading, u64 id) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  int result = 0;
+
+  if (d->m_polling) {
+    result = poll_until(aclpci, reading, id, ACL_PCIE_DMA_BOUNCE_TIMEOUT_MS, 0);
   } else {
-    set_desc_table_header(&d->desc_table_rd_cpu_virt_addr->header);
+    wait_event_timeout(aclpci->wait_q, chan_completed_id(aclpci, reading) >= id,
+                       msecs_to_jiffies(ACL_PCIE_DMA_BOUNCE_TIMEOUT_MS));
   }
 
-  if (d->m_us_valid == 1) {
-    d->m_us_valid = 0;
-    ktime_get_ts64(&us_end_time);
-    seconds = us_end_time.tv_sec - d->m_us_dma_start_time.tv_sec;
-    useconds = us_end_time.tv_nsec - d->m_us_dma_start_time.tv_nsec;
-    ACL_VERBOSE_DEBUG (KERN_DEBUG "Last table transfer measured %06ld nsec :: check seconds %ld should be zero", useconds, seconds);
+  if (chan_completed_id(aclpci, reading) < id) {
+    ACL_DEBUG (KERN_WARNING "DMA %llu didn't finish in time", id);
+    return result < 0 ? result : -ETIMEDOUT;
   }
+  return 0;
+}
 
-  queue_work(d->my_wq, &d->my_work->work);
 
-  return IRQ_HANDLED;
+/* Wait for the transfer with the given id on behalf of a synchronous
+ * read()/write(). Unlike wait_for_request(), the wait can be interrupted
+ * and the timeout is the user's. */
+static int wait_sync (struct aclpci_dev *aclpci, int reading, u64 id) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  long ret;
+
+  if (d->m_polling) {
+    return poll_until(aclpci, reading, id,
+                      d->m_sync_ms == ACLPCI_DMA_SYNC_FOREVER ? 0 : d->m_sync_ms, 0);
+  }
+
+  if (d->m_sync_ms == ACLPCI_DMA_SYNC_FOREVER) {
+    ret = wait_event_interruptible(aclpci->wait_q, chan_completed_id(aclpci, reading) >= id);
+  } else {
+    ret = wait_event_interruptible_timeout(aclpci->wait_q, chan_completed_id(aclpci, reading) >= id,
+                                           msecs_to_jiffies(d->m_sync_ms));
+  }
+  if (ret < 0) {
+    return -EINTR;
+  }
+  if (chan_completed_id(aclpci, reading) < id) {
+    ACL_DEBUG (KERN_DEBUG "DMA %llu not done after %u ms", id, d->m_sync_ms);
+    return -ETIMEDOUT;
+  }
+  return 0;
+}
+
+
+/* Wait for everything submitted so far to finish */
+int aclpci_dma_wait_idle (struct aclpci_dev *aclpci) {
+  u64 id = aclpci_dma_get_submitted_id(aclpci);
+  int reading, result;
+
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    result = wait_for_request(aclpci, reading, id);
+    if (result < 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+
+/* Wait for the transfer using one half of the bounce buffer and, for reads,
+ * copy its data out to the user. */
+static int retire_bounce_half (struct aclpci_dev *aclpci, int half, u64 id,
+                               void __user *user_addr, size_t bytes, int reading) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  size_t offset = half * (d->m_bounce.len / 2);
+  int result;
+
+  if (id == 0) {
+    return 0;
+  }
+  result = wait_for_request(aclpci, reading, id);
+  if (result < 0) {
+    // Requests in one direction finish in order, the last one covers both halves
+    d->m_bounce_pending = max(d->m_bounce_pending, id);
+    return result;
+  }
+  if (!reading) {
+    return 0;
+  }
+
+  dma_sync_single_for_cpu(&d->m_pci_dev->dev, d->m_bounce_extent.dma_addr + offset, bytes, DMA_BIDIRECTIONAL);
+  if (copy_to_user(user_addr, compute_address(d->m_bounce.ptr, offset), bytes)) {
+    return -EFAULT;
+  }
+  return 0;
+}
+
+
+/* Transfer a 64-byte aligned piece of device memory and wait for it to
+ * finish. The host address doesn't have to be aligned. If it isn't, the data
+ * is staged in the two halves of the bounce buffer, so the copy to/from the
+ * user of one half overlaps the DMA of the other.
+ * Returns -ENOMEM if there is no bounce buffer, or it is still used by a
+ * transfer whose waiter gave up on it. */
+ssize_t aclpci_dma_rw_sync (struct aclpci_dev *aclpci,
+                            void *dev_addr, void __user* user_addr,
+                            ssize_t len, int reading) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  size_t half = d->m_bounce.len / 2;
+  size_t chunk[2] = {0, 0};
+  void __user *user[2] = {NULL, NULL};
+  u64 id[2] = {0, 0};
+  size_t done = 0;
+  void *buf;
+  int i = 0, n, result = 0, ret;
+
+  if (((unsigned long)user_addr & DMA_ALIGNMENT_BYTE_MASK) == 0) {
+    if (reading) {
+      result = read_write (aclpci, dev_addr, user_addr, len, reading, NULL, 0, &id[0]);
+    } else {
+      result = read_write (aclpci, user_addr, dev_addr, len, reading, NULL, 0, &id[0]);
+    }
+    return result < 0 ? result : wait_for_request(aclpci, reading, id[0]);
+  }
+
+  if (d->m_bounce.extents == NULL) {
+    return -ENOMEM;
+  }
+  if (d->m_bounce_pending != 0) {
+    if (aclpci_dma_get_completed_id(aclpci) < d->m_bounce_pending) {
+      return -ENOMEM;
+    }
+    d->m_bounce_pending = 0;
+  }
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: %sing %lu bytes through the bounce buffer", reading ? "Read" : "Writ", len);
+  while (done < len) {
+    // Reuse the half whose transfer was started two chunks ago
+    result = retire_bounce_half(aclpci, i, id[i], user[i], chunk[i], reading);
+    id[i] = 0;
+    if (result < 0) {
+      break;
+    }
+
+    chunk[i] = min_t(size_t, half, len - done);
+    user[i] = user_addr + done;
+    buf = compute_address(d->m_bounce.ptr, i * half);
+    if (!reading && copy_from_user(buf, user[i], chunk[i])) {
+      result = -EFAULT;
+      break;
+    }
+    dma_sync_single_for_device(&d->m_pci_dev->dev, d->m_bounce_extent.dma_addr + i * half, chunk[i], DMA_BIDIRECTIONAL);
+    if (reading) {
+      result = read_write (aclpci, compute_address(dev_addr, done), buf, chunk[i], reading, &(d->m_bounce), 0, &id[i]);
+    } else {
+      result = read_write (aclpci, buf, compute_address(dev_addr, done), chunk[i], reading, &(d->m_bounce), 0, &id[i]);
+    }
+    if (result < 0) {
+      break;
+    }
+    done += chunk[i];
+    i ^= 1;
+  }
+
+  // The engine may still be using the buffer, so always wait for both
+  // halves. The older one goes first to keep reads in order.
+  for (n = 0; n < 2; n++, i ^= 1) {
+    ret = retire_bounce_half(aclpci, i, id[i], user[i], chunk[i], reading && result == 0);
+    if (result == 0) {
+      result = ret;
+    }
+  }
+  return result;
+}
+
+
+/* Take a free pool buffer. Returns its index, or -1 if all are in use.
+ * A buffer left to a read nobody waits for any more is free again once
+ * that read is done. m_pool_pending is only touched under
+ * m_requests_lock, same as the retirement of the read. */
+static int pool_get (struct aclpci_dev *aclpci) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned long flags;
+  int i, reclaimed;
+
+  for (i = 0; i < ACL_PCIE_DMA_POOL_BUFS; i++) {
+    if (d->m_pool[i].extents == NULL) {
+      continue;
+    }
+    spin_lock_irqsave(&d->m_requests_lock, flags);
+    reclaimed = d->m_pool_pending[i] != 0 &&
+                chan_completed_id_locked(aclpci, 1) >= d->m_pool_pending[i];
+    if (reclaimed) {
+      d->m_pool_pending[i] = 0;
+    }
+    spin_unlock_irqrestore(&d->m_requests_lock, flags);
+    if (reclaimed) {
+      return i;
+    }
+    if (!test_and_set_bit(i, &d->m_pool_busy)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+/* Give back the pool buffer of a write that is done or dropped. Reads give
+ * theirs back themselves, after copying the data out. */
+static void pool_put_request (struct aclpci_dma *d, struct dma_request *req) {
+
+  struct dma_region *r = req->host_buf;
+
+  if (req->reading) {
+    return;
+  }
+  if (r != NULL && r != &(d->m_bounce)) {
+    clear_bit(r - d->m_pool, &d->m_pool_busy);
+  }
+}
+
+
+/* Transfer through a pool buffer instead of pinning the user's pages.
+ * Writes are queued like any other transfer once the data is copied in.
+ * Reads have to wait for the data to copy it out to the user.
+ * Returns -ENOMEM if all pool buffers are in use. */
+static ssize_t pool_rw (struct aclpci_dev *aclpci,
+                        void *dev_addr, void __user* user_addr,
+                        ssize_t len, int reading) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region *r;
+  unsigned long flags;
+  u64 id;
+  int i, result;
+
+  i = pool_get(aclpci);
+  if (i < 0) {
+    return -ENOMEM;
+  }
+  r = &(d->m_pool[i]);
+
+  if (reading) {
+    dma_sync_single_for_device(&d->m_pci_dev->dev, r->extents->dma_addr, len, DMA_BIDIRECTIONAL);
+    result = read_write (aclpci, dev_addr, r->ptr, len, reading, r, 0, &id);
+    if (result == 0) {
+      result = wait_for_request(aclpci, reading, id);
+      if (result < 0) {
+        // The engine may still write to the buffer. pool_get() frees it.
+        spin_lock_irqsave(&d->m_requests_lock, flags);
+        d->m_pool_pending[i] = id;
+        spin_unlock_irqrestore(&d->m_requests_lock, flags);
+        return result;
+      }
+    }
+    if (result == 0) {
+      dma_sync_single_for_cpu(&d->m_pci_dev->dev, r->extents->dma_addr, len, DMA_BIDIRECTIONAL);
+      if (copy_to_user(user_addr, r->ptr, len)) {
+        result = -EFAULT;
+      }
+    }
+    clear_bit(i, &d->m_pool_busy);
+    return result;
+  }
+
+  if (copy_from_user(r->ptr, user_addr, len)) {
+    clear_bit(i, &d->m_pool_busy);
+    return -EFAULT;
+  }
+  dma_sync_single_for_device(&d->m_pci_dev->dev, r->extents->dma_addr, len, DMA_BIDIRECTIONAL);
+  result = read_write (aclpci, r->ptr, dev_addr, len, reading, r, d->m_sync_ms == 0, NULL);
+  if (result < 0) {
+    clear_bit(i, &d->m_pool_busy);
+  }
+  return result;
+}
+
+
+/* Read/Write large amounts of data using DMA.
+ *   dev_addr  -- address on device to read to/write from
+ *   dest_addr -- address in user space to read to/write from
+ *   len       -- number of bytes to transfer
+ *   reading   -- 1 if doing read (from device), 0 if doing write (to device)
+ *   sync_id   -- if not NULL, gets the id to pass to aclpci_dma_wait_sync()
+ *                in sync mode, 0 otherwise
+ * Returns once the transfer is queued.
+ */
+ssize_t aclpci_dma_rw (struct aclpci_dev *aclpci,
+                       void *dev_addr, void __user* user_addr,
+                       ssize_t len, int reading, u64 *sync_id) {
+
+  ssize_t result = -ENOMEM;
+
+  if (sync_id != NULL) {
+    *sync_id = 0;
+  }
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: %sing %lu bytes", reading ? "Read" : "Writ", len);
+  if (len < aclpci->dma_pin_min[reading] && len <= ACL_PCIE_DMA_POOL_BUF_SIZE) {
+    result = pool_rw (aclpci, dev_addr, user_addr, len, reading);
+  }
+  if (result == -ENOMEM) {
+    if (reading) {
+      result = read_write (aclpci, dev_addr,  user_addr, len, reading, NULL, aclpci->dma_data.m_sync_ms == 0, NULL);
+    } else {
+      result = read_write (aclpci, user_addr,  dev_addr, len, reading, NULL, aclpci->dma_data.m_sync_ms == 0, NULL);
+    }
+  }
+
+  // Submissions are serialized by aclpci->sem, so the last one is ours
+  if (result == 0 && sync_id != NULL && aclpci->dma_data.m_sync_ms != 0) {
+    *sync_id = aclpci_dma_get_submitted_id(aclpci);
+  }
+  return result;
+}
+
+
+/* Wait for the transfer a DMA read()/write() queued in sync mode, see
+ * sync_id of aclpci_dma_rw(). Called after releasing aclpci->sem, so the
+ * device stays usable while the caller sleeps. */
+int aclpci_dma_wait_sync (struct aclpci_dev *aclpci, int reading, u64 id) {
+
+  if (id == 0 || aclpci->dma_data.m_sync_ms == 0) {
+    return 0;
+  }
+  return wait_sync (aclpci, reading, id);
+}
+
+
+/* Queue a transfer for an io_uring command, which is completed when the
+ * transfer is done instead of signalling the user. Small writes go through
+ * the bounce pool. Reads never do, since that would mean waiting here for
+ * the data. */
+int aclpci_dma_rw_uring (struct aclpci_dev *aclpci,
+                         void *dev_addr, void __user* user_addr,
+                         ssize_t len, int reading, void *uring_cmd) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_request req;
+  struct dma_region *r;
+  int b, result;
+
+  req.reading = reading;
+  req.bytes = len;
+  req.host_addr = user_addr;
+  req.device_addr = dev_addr;
+  req.notify = 0;
+  req.uring_cmd = uring_cmd;
+  req.host_buf = NULL;
+
+  if (!reading && len < aclpci->dma_pin_min[reading] && len <= ACL_PCIE_DMA_POOL_BUF_SIZE) {
+    b = pool_get(aclpci);
+    if (b >= 0) {
+      r = &(d->m_pool[b]);
+      if (copy_from_user(r->ptr, user_addr, len)) {
+        clear_bit(b, &d->m_pool_busy);
+        return -EFAULT;
+      }
+      dma_sync_single_for_device(&d->m_pci_dev->dev, r->extents->dma_addr, len, DMA_BIDIRECTIONAL);
+      req.host_addr = r->ptr;
+      req.host_buf = r;
+    }
+  }
+
+  result = queue_requests (aclpci, &req, 1, reading, NULL);
+  if (result < 0) {
+    pool_put_request(d, &req);
+  }
+  return result;
+}
+
+
+/* Queue a vectored transfer of count segments, all in one direction. Each
+ * segment has to meet the DMA alignment rules. The segments are queued
+ * together, run back to back, and the user is signalled once, when the
+ * last one is done. Small writes are copied through the bounce pool as
+ * long as it has free buffers. sync_id is the same as for aclpci_dma_rw(). */
+ssize_t aclpci_dma_rw_vector (struct aclpci_dev *aclpci,
+                              struct acl_dma_segment __user *segs,
+                              size_t count, int reading, u64 *sync_id) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct acl_dma_segment *ksegs;
+  struct dma_request *reqs;
+  struct dma_region *r;
+  size_t i;
+  int b;
+  ssize_t result;
+
+  if (sync_id != NULL) {
+    *sync_id = 0;
+  }
+  if (count == 0 || count > ACL_PCIE_DMA_MAX_REQUESTS) {
+    return -EINVAL;
+  }
+
+  ksegs = (struct acl_dma_segment *)kmalloc (count * sizeof(struct acl_dma_segment), GFP_KERNEL);
+  reqs = (struct dma_request *)kmalloc (count * sizeof(struct dma_request), GFP_KERNEL);
+  if (ksegs == NULL || reqs == NULL) {
+    result = -ENOMEM;
+    goto done;
+  }
+  if (copy_from_user (ksegs, segs, count * sizeof(struct acl_dma_segment))) {
+    result = -EFAULT;
+    goto done;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (ksegs[i].size == 0 ||
+        (((unsigned long)ksegs[i].device_addr | (unsigned long)ksegs[i].user_addr | ksegs[i].size) & DMA_ALIGNMENT_BYTE_MASK) != 0) {
+      ACL_DEBUG (KERN_WARNING "DMA vector segment %lu is empty or not aligned", i);
+      result = -EINVAL;
+      goto done;
+    }
+    reqs[i].device_addr = ksegs[i].device_addr;
+    reqs[i].host_addr = ksegs[i].user_addr;
+    reqs[i].bytes = ksegs[i].size;
+    reqs[i].reading = reading;
+    reqs[i].notify = (i == count - 1 && d->m_sync_ms == 0);
+    reqs[i].uring_cmd = NULL;
+    reqs[i].host_buf = NULL;
+  }
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: %sing %lu segments", reading ? "Read" : "Writ", count);
+  for (i = 0; i < count && !reading; i++) {
+    if (reqs[i].bytes >= aclpci->dma_pin_min[reading] || reqs[i].bytes > ACL_PCIE_DMA_POOL_BUF_SIZE) {
+      continue;
+    }
+    b = pool_get(aclpci);
+    if (b < 0) {
+      break;
+    }
+    r = &(d->m_pool[b]);
+    if (copy_from_user(r->ptr, reqs[i].host_addr, reqs[i].bytes)) {
+      clear_bit(b, &d->m_pool_busy);
+      result = -EFAULT;
+      goto fail;
+    }
+    dma_sync_single_for_device(&d->m_pci_dev->dev, r->extents->dma_addr, reqs[i].bytes, DMA_BIDIRECTIONAL);
+    reqs[i].host_addr = r->ptr;
+    reqs[i].host_buf = r;
+  }
+
+  result = queue_requests (aclpci, reqs, count, reading, NULL);
+  if (result == 0) {
+    if (sync_id != NULL && d->m_sync_ms != 0) {
+      *sync_id = reqs[count - 1].id;
+    }
+    goto done;
+  }
+
+fail:
+  // Nothing was queued, give back the pool buffers
+  for (i = 0; i < count; i++) {
+    pool_put_request(d, &reqs[i]);
+  }
+done:
+  kfree(ksegs);
+  kfree(reqs);
+  return result;
+}
+
+
+/* Return idle status of the DMA hardware.
+ * Only idle once every queued transfer in both directions is done. */
+int aclpci_dma_get_idle_status(struct aclpci_dev *aclpci) {
+  return get_chan(aclpci, 0)->m_idle && get_chan(aclpci, 1)->m_idle;
+}
+
+
+/* Switch polling mode on or off. See aclpci_dma_poll(). */
+int aclpci_dma_set_polling(struct aclpci_dev *aclpci, int polling) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned long flags;
+  int ret = 0;
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  if (!get_chan(aclpci, 0)->m_idle || !get_chan(aclpci, 1)->m_idle) {
+    ret = -EBUSY;
+  } else {
+    d->m_polling = polling;
+  }
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA polling mode %s", polling ? "on" : "off");
+  return ret;
+}
+
+
+/* Polling mode: do the interrupt's work from the calling thread. Whenever a
+ * channel's batch of descriptors is done, or a transfer was just submitted,
+ * the next batch is built and started right here. Polling mode is per
+ * device, not per open handle: any thread polling moves the transfers of
+ * both channels along, whoever submitted them.
+ * Returns once the transfer with the given id, queued in the given
+ * direction, is done, or if id is 0, once both channels are idle. Gives up
+ * after timeout_ms, unless it is 0. Spins for dma_poll_spin_us after the
+ * last progress, then sleeps between checks so an idle caller doesn't keep
+ * a core busy. If drop_sem, the caller holds aclpci->sem, and releases it
+ * while sleeping so other users of the device aren't locked out. */
+static int poll_until (struct aclpci_dev *aclpci, int reading, u64 id,
+                       unsigned int timeout_ms, int drop_sem) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c;
+  unsigned long deadline = jiffies + msecs_to_jiffies(timeout_ms);
+  u64 spin_end;
+  int chan, busy, progress, result = 0;
+
+  spin_end = ktime_get_ns() + (u64)dma_poll_spin_us * NSEC_PER_USEC;
+  for (;;) {
+    // Polling may have been switched off while the semaphore was released
+    if (!d->m_polling) {
+      return 0;
+    }
+    busy = progress = 0;
+    for (chan = 0; chan < ACL_DMA_NUM_CHANS; chan++) {
+      c = get_chan(aclpci, chan);
+      if (c->m_idle) {
+        continue;
+      }
+      busy = 1;
+
+      mutex_lock(&c->m_update_lock);
+      if (!c->m_idle && (!c->m_in_flight || aclpci_dma_chan_done(c))) {
+        // Same as the interrupt handler does before the update
+        set_desc_table_header(&c->desc_table->header);
+        result = aclpci_dma_update(aclpci, chan, 1);
+        progress = 1;
+      }
+      mutex_unlock(&c->m_update_lock);
+      if (result < 0) {
+        return result;
+      }
+    }
+
+    if (id == 0 ? !busy : chan_completed_id(aclpci, reading) >= id) {
+      return 0;
+    }
+    if (progress) {
+      spin_end = ktime_get_ns() + (u64)dma_poll_spin_us * NSEC_PER_USEC;
+    } else if (ktime_get_ns() < spin_end) {
+      cpu_relax();
+    } else {
+      if (signal_pending(current)) {
+        return -ERESTARTSYS;
+      }
+      if (timeout_ms != 0 && time_after(jiffies, deadline)) {
+        return -ETIMEDOUT;
+      }
+      if (drop_sem) {
+        up(&aclpci->sem);
+      }
+      usleep_range(dma_poll_sleep_us, 2 * dma_poll_sleep_us);
+      if (drop_sem) {
+        down(&aclpci->sem);
+      }
+    }
+  }
+}
+
+/* ACLPCI_CMD_DMA_UPDATE: poll until everything submitted so far is done.
+ * Called with aclpci->sem held, see poll_until(). */
+int aclpci_dma_poll(struct aclpci_dev *aclpci) {
+
+  if (!aclpci->dma_data.m_polling) {
+    return 0;
+  }
+  return poll_until(aclpci, 0, 0, 0, 1);
+}
+
+/* Make DMA read()/write() wait for the transfer. See
+ * ACLPCI_CMD_SET_DMA_SYNC. Called with aclpci->sem held. */
+void aclpci_dma_set_sync(struct aclpci_dev *aclpci, unsigned int timeout_ms) {
+  aclpci->dma_data.m_sync_ms = timeout_ms;
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA sync mode timeout %u ms", timeout_ms);
+}
+
+/* Id of the most recently submitted transfer */
+u64 aclpci_dma_get_submitted_id(struct aclpci_dev *aclpci) {
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned long flags;
+  u64 id;
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  id = d->m_last_submitted_id;
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
+  return id;
+}
+
+/* Largest id such that it and all smaller ids are done. Each channel
+ * completes its transfers in order, so this is one less than the oldest
+ * transfer still queued on either channel. */
+static u64 completed_id_locked(struct aclpci_dev *aclpci) {
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_request *req;
+  int reading;
+  u64 id;
+
+  id = d->m_last_submitted_id;
+  for (reading = 0; reading < ACL_DMA_NUM_CHANS; reading++) {
+    req = (struct dma_request *)queue_front(&get_chan(aclpci, reading)->m_requests);
+    if (req != NULL && req->id - 1 < id) {
+      id = req->id - 1;
+    }
+  }
+  return id;
+}
+
+u64 aclpci_dma_get_completed_id(struct aclpci_dev *aclpci) {
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned long flags;
+  u64 id;
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  id = completed_id_locked(aclpci);
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
+  return id;
+}
+
+/* Same for the transfers queued in one direction: every transfer in that
+ * direction with an id up to this one is done. */
+static u64 chan_completed_id_locked(struct aclpci_dev *aclpci, int reading) {
+  struct dma_request *req;
+
+  req = (struct dma_request *)queue_front(&get_chan(aclpci, reading)->m_requests);
+  return (req != NULL) ? req->id - 1 : aclpci->dma_data.m_last_submitted_id;
+}
+
+static u64 chan_completed_id(struct aclpci_dev *aclpci, int reading) {
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned long flags;
+  u64 id;
+
+  spin_lock_irqsave(&d->m_requests_lock, flags);
+  id = chan_completed_id_locked(aclpci, reading);
+  spin_unlock_irqrestore(&d->m_requests_lock, flags);
+  return id;
+}
+
+
+/* Bring the DMA part of the status page up to date. If done_id isn't 0,
+ * that transfer just retired with status, and gets a ring entry. Called
+ * with m_requests_lock held. */
+static void update_status_page(struct aclpci_dev *aclpci, u64 done_id, long status) {
+  struct acl_status_page *page = aclpci->status_page;
+  struct acl_status_entry *e;
+  u64 head;
+
+  if (done_id != 0) {
+    head = page->ring_head;
+    e = &(page->ring[head % ACLPCI_STATUS_RING_ENTRIES]);
+    WRITE_ONCE(e->id, done_id);
+    WRITE_ONCE(e->status, status);
+    // User space reads ring_head before the entry
+    smp_wmb();
+    WRITE_ONCE(page->ring_head, head + 1);
+  }
+  WRITE_ONCE(page->dma_submitted_id, aclpci->dma_data.m_last_submitted_id);
+  WRITE_ONCE(page->dma_completed_id, completed_id_locked(aclpci));
+  WRITE_ONCE(page->dma_idle, aclpci_dma_get_idle_status(aclpci));
+}
+
+
+/* Slot for a new region, or NULL if all are taken. Called with
+ * m_regions_lock held. */
+static struct dma_region *find_free_region (struct aclpci_dma *d) {
+  int i;
+  for (i = 0; i < ACL_PCIE_DMA_MAX_REGIONS; i++) {
+    if (d->m_regions[i].extents == NULL) {
+      return &(d->m_regions[i]);
+    }
+  }
+  ACL_DEBUG (KERN_WARNING "All %d DMA regions are in use", ACL_PCIE_DMA_MAX_REGIONS);
+  return NULL;
+}
+
+
+/* Take an extent array for a window of num_pages from the window pool.
+ * Returns NULL if the window is too large or the pool is empty. */
+static struct dma_extent *win_pool_get (struct aclpci_dma *d, unsigned int num_pages) {
+
+  int i;
+
+  if (num_pages > ACL_PCIE_DMA_PIN_BATCH) {
+    return NULL;
+  }
+  for (i = 0; i < ACL_PCIE_DMA_WIN_POOL; i++) {
+    if (d->m_win_pool[i] != NULL && !test_and_set_bit(i, &d->m_win_busy)) {
+      return d->m_win_pool[i]->extents;
+    }
+  }
+  return NULL;
+}
+
+/* Index of the window pool entry e belongs to, or -1 if it was allocated
+ * on its own */
+static int win_pool_index (struct aclpci_dma *d, struct dma_extent *e) {
+
+  int i;
+
+  for (i = 0; i < ACL_PCIE_DMA_WIN_POOL; i++) {
+    if (d->m_win_pool[i] != NULL && d->m_win_pool[i]->extents == e) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Free an extent array, or give it back to the window pool */
+static void free_extents (struct aclpci_dma *d, struct dma_extent *e) {
+
+  int i = win_pool_index(d, e);
+
+  if (i >= 0) {
+    clear_bit(i, &d->m_win_busy);
+  } else {
+    kfree (e);
+  }
+}
+
+
+/* Pin num_pages user pages starting at the page-aligned address start, and
+ * collect them into extents of physically contiguous pages. Pages are
+ * pinned ACL_PCIE_DMA_PIN_BATCH at a time, so registering a large buffer
+ * doesn't need a per-page array for all of it. DMA windows pass their
+ * channel's scratch array as pages, so they don't allocate one. Windows
+ * that are unpinned when done also set pooled, and get their extent array
+ * from the window pool. Registered regions and windows going into the
+ * pinned-page cache keep their extents indefinitely, so they allocate them
+ * and leave the pool to short-lived windows. For the same reason only they
+ * are held to RLIMIT_MEMLOCK, and fail with -ENOMEM past it. */
+static int pin_user_extents (struct aclpci_dev *aclpci, unsigned long start, unsigned int num_pages,
+                             struct page **pages, int pooled,
+                             struct dma_extent **extents, unsigned int *num_extents) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_extent *e = NULL, *grown;
+  struct page **batch = pages;
+  unsigned int n = 0, size = 0, done, count, i;
+  int ret = 0;
+
+  if (batch == NULL) {
+    batch = (struct page **)kvmalloc_array (min_t(unsigned int, num_pages, ACL_PCIE_DMA_PIN_BATCH),
+                                            sizeof(struct page *), GFP_KERNEL);
+    if (batch == NULL) {
+      return -ENOMEM;
+    }
+  } else if (pooled) {
+    // Room for every page of the window, so it never has to grow
+    e = win_pool_get(d, num_pages);
+    if (e != NULL) {
+      size = num_pages;
+    }
+  }
+
+  for (done = 0; done < num_pages; done += count) {
+    count = num_pages - done;
+    if (count > ACL_PCIE_DMA_PIN_BATCH) {
+      count = ACL_PCIE_DMA_PIN_BATCH;
+    }
+    ret = aclpci_get_user_pages(aclpci->user_task, start + ((unsigned long)done << PAGE_SHIFT), count, batch, !pooled);
+    if (ret != 0) {
+      break;
+    }
+
+    for (i = 0; i < count; i++) {
+      if (n > 0 && page_to_pfn(batch[i]) == page_to_pfn(e[n-1].page) + e[n-1].num_pages &&
+          e[n-1].num_pages < (UINT_MAX >> PAGE_SHIFT)) {
+        e[n-1].num_pages++;
+        continue;
+      }
+      if (n == size) {
+        size = size ? size * 2 : 16;
+        grown = (struct dma_extent *)krealloc (e, sizeof(struct dma_extent) * size, GFP_KERNEL);
+        if (grown == NULL) {
+          aclpci_release_user_pages (aclpci->user_task, batch + i, count - i, 0);
+          ret = -ENOMEM;
+          break;
+        }
+        e = grown;
+      }
+      e[n].page = batch[i];
+      e[n].dma_addr = 0;
+      e[n].num_pages = 1;
+      n++;
+    }
+    if (ret != 0) {
+      break;
+    }
+  }
+  if (batch != pages) {
+    kvfree(batch);
+  }
+
+  if (ret != 0) {
+    if (n > 0) {
+      aclpci_release_user_extents (aclpci->user_task, e, n, 0);
+    }
+    free_extents (d, e);
+    return ret;
+  }
+
+  *extents = e;
+  *num_extents = n;
+  return 0;
+}
+
+
+/* Map the extents for PCI access through sgt, one scatterlist entry per
+ * extent, and store each extent's bus address. Windows from the window pool
+ * use its scatterlist, everything else allocates one. Pages are always
+ * mapped both ways, so cached windows and regions can be reused in either
+ * direction. */
+static int map_extents (struct aclpci_dma *d, struct dma_extent *e, unsigned int n, struct sg_table *sgt) {
+
+  struct scatterlist *sg;
+  dma_addr_t addr;
+  size_t len;
+  unsigned int i, j;
+  int w;
+
+  w = win_pool_index(d, e);
+  if (w >= 0) {
+    sgt->sgl = d->m_win_pool[w]->sgl;
+    sgt->orig_nents = n;
+    sg_init_table(sgt->sgl, n);
+  } else if (sg_alloc_table(sgt, n, GFP_KERNEL) != 0) {
+    return -ENOMEM;
+  }
+
+  for_each_sg(sgt->sgl, sg, n, i) {
+    sg_set_page(sg, e[i].page, e[i].num_pages << PAGE_SHIFT, 0);
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  if (dma_map_sgtable(&d->m_pci_dev->dev, sgt, DMA_BIDIRECTIONAL, 0) != 0) {
+    sgt->nents = 0;
+  }
+#else
+  sgt->nents = dma_map_sg(&d->m_pci_dev->dev, sgt->sgl, sgt->orig_nents, DMA_BIDIRECTIONAL);
+#endif
+  if (sgt->nents == 0) {
+    ACL_DEBUG (KERN_DEBUG "  Couldn't map %u extents for DMA!", n);
+    if (w < 0) {
+      sg_free_table(sgt);
+    }
+    memset (sgt, 0, sizeof(struct sg_table));
+    return -EFAULT;
+  }
+
+  // Each mapped segment covers one or more whole extents, in order
+  j = 0;
+  for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+    addr = sg_dma_address(sg);
+    for (len = 0; len < sg_dma_len(sg) && j < n; j++) {
+      e[j].dma_addr = addr + len;
+      len += (size_t)e[j].num_pages << PAGE_SHIFT;
+    }
+  }
+  return 0;
+}
+
+static void unmap_extents (struct aclpci_dma *d, struct dma_extent *e, struct sg_table *sgt) {
+
+  if (sgt->sgl == NULL) {
+    return;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  dma_unmap_sgtable(&d->m_pci_dev->dev, sgt, DMA_BIDIRECTIONAL, 0);
+#else
+  dma_unmap_sg(&d->m_pci_dev->dev, sgt->sgl, sgt->orig_nents, DMA_BIDIRECTIONAL);
+#endif
+  if (win_pool_index(d, e) < 0) {
+    sg_free_table(sgt);
+  }
+  memset (sgt, 0, sizeof(struct sg_table));
+}
+
+/* Make the pages of a window borrowed from a region, which stay mapped,
+ * visible to the device before the transfer, or to the CPU after it. */
+static void sync_window (struct aclpci_dma *d, struct dma_t *dma, int for_cpu) {
+
+  struct dma_extent *e = dma->extents;
+  unsigned int first = dma->first_page, left = dma->num_pages, n;
+  dma_addr_t addr;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  // Nothing to do on cache-coherent hosts without bounce buffering
+  if (!dma_need_sync(&d->m_pci_dev->dev, e->dma_addr)) {
+    return;
+  }
+#endif
+
+  for (; left > 0; e++, first = 0) {
+    n = min(e->num_pages - first, left);
+    addr = e->dma_addr + ((dma_addr_t)first << PAGE_SHIFT);
+    if (for_cpu) {
+      dma_sync_single_for_cpu(&d->m_pci_dev->dev, addr, (size_t)n << PAGE_SHIFT, DMA_BIDIRECTIONAL);
+    } else {
+      dma_sync_single_for_device(&d->m_pci_dev->dev, addr, (size_t)n << PAGE_SHIFT, DMA_BIDIRECTIONAL);
+    }
+    left -= n;
+  }
+}
+
+
+/* Pin and map len bytes of user memory at addr for the whole lifetime of
+ * the region. On success, *handle identifies the region.
+ * The user pages are pinned before taking m_regions_lock. mmap() takes
+ * m_regions_lock with the mmap lock held, so the mmap lock must never be
+ * taken under it. */
+int aclpci_dma_register_region(struct aclpci_dev *aclpci, void __user *addr, size_t len, u32 *handle) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region tmp, *r;
+  ssize_t start_page, end_page;
+  int ret;
+
+  if (addr == NULL || len == 0 || aclpci->user_task == NULL) {
+    return -EINVAL;
+  }
+
+  memset (&tmp, 0, sizeof(struct dma_region));
+  start_page = (ssize_t)addr >> PAGE_SHIFT;
+  end_page = ((ssize_t)addr + len - 1) >> PAGE_SHIFT;
+  tmp.num_pages = end_page - start_page + 1;
+  tmp.dir = DMA_BIDIRECTIONAL;
+
+  // Fails with -ENOMEM past RLIMIT_MEMLOCK, the pages stay pinned until
+  // unregistered
+  ret = pin_user_extents (aclpci, (unsigned long)addr & PAGE_MASK, tmp.num_pages, NULL, 0, &tmp.extents, &tmp.num_extents);
+  if (ret != 0) {
+    ACL_DEBUG (KERN_WARNING "Couldn't pin all user pages. %d!\n", ret);
+    return (ret == -ENOMEM) ? ret : -EFAULT;
+  }
+
+  if (map_extents (d, tmp.extents, tmp.num_extents, &tmp.sgt) != 0) {
+    aclpci_release_user_extents (aclpci->user_task, tmp.extents, tmp.num_extents, 0);
+    kfree (tmp.extents);
+    return -EFAULT;
+  }
+
+  tmp.ptr = addr;
+  tmp.len = len;
+
+  mutex_lock(&d->m_regions_lock);
+  r = find_free_region (d);
+  if (r != NULL) {
+    *r = tmp;
+    *handle = (u32)(r - d->m_regions) + 1;
+  }
+  mutex_unlock(&d->m_regions_lock);
+
+  if (r == NULL) {
+    release_region (aclpci, &tmp);
+    return -ENOMEM;
+  }
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: Registered %lu bytes (%u pages in %u extents) at 0x%p as region %u",
+                     len, tmp.num_pages, tmp.num_extents, addr, *handle);
+  return 0;
+}
+
+
+/* Free a bounce buffer. */
+static void free_dma_buffer (struct aclpci_dev *aclpci, struct dma_region *r) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  unsigned int i;
+
+  for (i = 0; i < r->num_extents; i++) {
+    if (r->extents[i].dma_addr != 0) {
+      dma_unmap_page (&d->m_pci_dev->dev, r->extents[i].dma_addr, (size_t)r->extents[i].num_pages << PAGE_SHIFT, r->dir);
+    }
+    __free_pages (r->extents[i].page, get_order((size_t)r->extents[i].num_pages << PAGE_SHIFT));
+  }
+}
+
+
+/* Drop a reference to a driver-allocated buffer, and free it with the
+ * last one. May be called from munmap() with the mmap lock held. */
+static void put_dma_buffer (struct dma_buffer *buf) {
+
+  struct dma_extent *e;
+  unsigned int i;
+
+  if (!atomic_dec_and_test(&buf->refs)) {
+    return;
+  }
+  for (i = 0; i < buf->num_extents; i++) {
+    e = &(buf->extents[i]);
+    if (e->dma_addr != 0) {
+      dma_unmap_page (buf->dev, e->dma_addr, (size_t)e->num_pages << PAGE_SHIFT, DMA_BIDIRECTIONAL);
+    }
+    __free_pages (e->page, get_order((size_t)e->num_pages << PAGE_SHIFT));
+  }
+  if (buf->mm != NULL) {
+    aclpci_account_pinned (buf->mm, -(long)buf->num_pages);
+    mmdrop (buf->mm);
+  }
+  put_device (buf->dev);
+  kvfree (buf->extents);
+  kfree (buf);
+}
+
+
+/* Unpin and unmap a region, or let go of it if the driver allocated it.
+ * r must not be reachable through m_regions or the pinned-page cache any
+ * more. */
+static void release_region (struct aclpci_dev *aclpci, struct dma_region *r) {
+
+  if (r->buf != NULL) {
+    // Still there if mapped, until the last munmap()
+    put_dma_buffer (r->buf);
+  } else {
+    unmap_extents (&(aclpci->dma_data), r->extents, &r->sgt);
+    aclpci_release_user_extents (aclpci->user_task, r->extents, r->num_extents, r->dir != DMA_TO_DEVICE);
+    free_extents (&(aclpci->dma_data), r->extents);
+  }
+  memset (r, 0, sizeof(struct dma_region));
+}
+
+
+/* Take region 'handle' out of the table into *out, so it can be released
+ * without holding m_regions_lock. owned selects between registered user
+ * buffers and driver-allocated ones. */
+static int take_region (struct aclpci_dev *aclpci, u32 handle, int owned, struct dma_region *out) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region *r;
+  int ret = 0;
+
+  if (handle == 0 || handle > ACL_PCIE_DMA_MAX_REGIONS) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&d->m_regions_lock);
+  r = &(d->m_regions[handle - 1]);
+  if (r->extents == NULL || (r->buf != NULL) != owned) {
+    ret = -EINVAL;
+  } else if (r->refcount != 0 || (owned && atomic_read(&r->buf->mmap_count) != 0)) {
+    ACL_DEBUG (KERN_WARNING "DMA region %u is still in use", handle);
+    ret = -EBUSY;
+  } else {
+    *out = *r;
+    memset (r, 0, sizeof(struct dma_region));
+  }
+  mutex_unlock(&d->m_regions_lock);
+  return ret;
+}
+
+
+int aclpci_dma_unregister_region(struct aclpci_dev *aclpci, u32 handle) {
+
+  struct dma_region r;
+  int ret;
+
+  ret = take_region (aclpci, handle, 0, &r);
+  if (ret == 0) {
+    release_region (aclpci, &r);
+  }
+  return ret;
+}
+
+
+/* Allocate a DMA buffer of len bytes owned by the driver. It is made of
+ * physically contiguous chunks, as large as the allocator will give
+ * (up to ACL_PCIE_DMA_BUF_MAX_ORDER), mapped for DMA once. User space
+ * gets to it by mmap()ing the device at offset handle * PAGE_SIZE.
+ * Transfers from/to the mapping never pin pages, and each chunk becomes
+ * as few descriptors as the length field allows. The pages can't be
+ * swapped out, so they are charged to the caller's pinned_vm. */
+int aclpci_dma_alloc_buffer(struct aclpci_dev *aclpci, size_t len, u32 *handle) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region tmp, *r;
+  struct dma_buffer *buf;
+  struct dma_extent *e;
+  struct page *page;
+  unsigned int order, pages_left, i;
+  int ret;
+
+  if (len == 0 || len > ACL_PCIE_DMA_BUF_MAX_SIZE) {
+    return -EINVAL;
+  }
+
+  buf = (struct dma_buffer *)kzalloc ( sizeof(struct dma_buffer), GFP_KERNEL );
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  atomic_set(&buf->refs, 1);
+  buf->dev = get_device (&d->m_pci_dev->dev);
+  buf->num_pages = PAGE_ALIGN(len) >> PAGE_SHIFT;
+
+  // Worst case is one chunk per page
+  buf->extents = (struct dma_extent*)kvcalloc ( buf->num_pages, sizeof(struct dma_extent), GFP_KERNEL );
+  if (buf->extents == NULL) {
+    ACL_DEBUG (KERN_WARNING "Couldn't allocate chunk array for %u pages!", buf->num_pages);
+    ret = -ENOMEM;
+    goto fail;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+  // Before 5.0, pinned_vm needs the mmap lock, which munmap() already
+  // holds when it frees the buffer. Only the size limit applies there.
+  ret = aclpci_charge_pinned (current, current->mm, buf->num_pages);
+  if (ret != 0) {
+    ACL_DEBUG (KERN_DEBUG "DMA buffer of %u pages would exceed RLIMIT_MEMLOCK", buf->num_pages);
+    goto fail;
+  }
+  buf->mm = current->mm;
+  mmgrab (buf->mm);
+#endif
+
+  order = ACL_PCIE_DMA_BUF_MAX_ORDER;
+  for (i = 0; i < buf->num_pages; i += (1 << order)) {
+    pages_left = buf->num_pages - i;
+    while ((1U << order) > pages_left) {
+      order--;
+    }
+    // Fall back to smaller chunks when memory is fragmented
+    for (;;) {
+      page = alloc_pages (GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | (order ? __GFP_NORETRY : 0), order);
+      if (page != NULL || order == 0) {
+        break;
+      }
+      order--;
+    }
+    if (page == NULL) {
+      ACL_DEBUG (KERN_WARNING "Couldn't allocate DMA buffer of %lu bytes", len);
+      ret = -ENOMEM;
+      goto fail;
+    }
+
+    e = &(buf->extents[buf->num_extents++]);
+    e->page = page;
+    e->num_pages = 1 << order;
+    e->dma_addr = dma_map_page (buf->dev, page, 0, PAGE_SIZE << order, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error (buf->dev, e->dma_addr)) {
+      e->dma_addr = 0;
+      ACL_DEBUG (KERN_WARNING "Couldn't map DMA buffer chunk");
+      ret = -EFAULT;
+      goto fail;
+    }
+  }
+
+  memset (&tmp, 0, sizeof(struct dma_region));
+  tmp.len = (size_t)buf->num_pages << PAGE_SHIFT;
+  tmp.dir = DMA_BIDIRECTIONAL;
+  tmp.extents = buf->extents;
+  tmp.num_extents = buf->num_extents;
+  tmp.num_pages = buf->num_pages;
+  tmp.buf = buf;
+
+  mutex_lock(&d->m_regions_lock);
+  r = find_free_region (d);
+  if (r != NULL) {
+    *r = tmp;
+    *handle = (u32)(r - d->m_regions) + 1;
+  }
+  mutex_unlock(&d->m_regions_lock);
+
+  if (r == NULL) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: Allocated %lu bytes in %u chunks as buffer %u",
+                     tmp.len, tmp.num_extents, *handle);
+  return 0;
+
+fail:
+  put_dma_buffer (buf);
+  return ret;
+}
+
+
+int aclpci_dma_free_buffer(struct aclpci_dev *aclpci, u32 handle) {
+
+  struct dma_region r;
+  int ret;
+
+  ret = take_region (aclpci, handle, 1, &r);
+  if (ret == 0) {
+    release_region (aclpci, &r);
+  }
+  return ret;
+}
+
+
+static void dma_buffer_vma_open (struct vm_area_struct *vma) {
+  struct dma_buffer *buf = (struct dma_buffer *)vma->vm_private_data;
+  atomic_inc(&buf->refs);
+  atomic_inc(&buf->mmap_count);
+}
+
+static void dma_buffer_vma_close (struct vm_area_struct *vma) {
+  struct dma_buffer *buf = (struct dma_buffer *)vma->vm_private_data;
+  atomic_dec(&buf->mmap_count);
+  put_dma_buffer (buf);
+}
+
+static const struct vm_operations_struct dma_buffer_vm_ops = {
+  .open = dma_buffer_vma_open,
+  .close = dma_buffer_vma_close,
+};
+
+/* mmap() handler. vm_pgoff is the handle of a buffer from
+ * aclpci_dma_alloc_buffer(), and the whole buffer must be mapped. The
+ * mapping holds a reference to the pages, not to the handle.
+ * Called with the mmap lock held. */
+int aclpci_dma_mmap(struct aclpci_dev *aclpci, struct vm_area_struct *vma) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region *r;
+  struct dma_buffer *buf;
+  unsigned long addr;
+  unsigned int i;
+  int ret = 0;
+
+  if (vma->vm_pgoff == 0 || vma->vm_pgoff > ACL_PCIE_DMA_MAX_REGIONS) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&d->m_regions_lock);
+  r = &(d->m_regions[vma->vm_pgoff - 1]);
+  buf = r->buf;
+  if (buf == NULL || vma->vm_end - vma->vm_start != r->len) {
+    ret = -EINVAL;
+    goto done;
+  }
+
+  addr = vma->vm_start;
+  for (i = 0; i < buf->num_extents; i++) {
+    ret = remap_pfn_range (vma, addr, page_to_pfn(buf->extents[i].page),
+                           (size_t)buf->extents[i].num_pages << PAGE_SHIFT, vma->vm_page_prot);
+    if (ret != 0) {
+      goto done;
+    }
+    addr += (size_t)buf->extents[i].num_pages << PAGE_SHIFT;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY);
+#else
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+#endif
+  vma->vm_private_data = buf;
+  vma->vm_ops = &dma_buffer_vm_ops;
+  dma_buffer_vma_open (vma);
+
+done:
+  mutex_unlock(&d->m_regions_lock);
+  return ret;
+}
+
+
+/* Point dma at the part of region r it covers, from page 'first' of r on. */
+static void slice_region_at (struct dma_region *r, struct dma_t *dma, unsigned long first) {
+
+  struct dma_extent *e = r->extents;
+
+  while (first >= e->num_pages) {
+    first -= e->num_pages;
+    e++;
+  }
+  dma->extents = e;
+  dma->num_extents = r->num_extents - (e - r->extents);
+  dma->first_page = first;
+  dma->region = r;
+}
+
+/* Same, for a region with a user address */
+static void slice_region (struct dma_region *r, struct dma_t *dma) {
+  slice_region_at (r, dma, ((unsigned long)dma->ptr >> PAGE_SHIFT) - ((unsigned long)r->ptr >> PAGE_SHIFT));
+}
+
+
+/* Same as borrow_region_pages(), for a mapping of a driver-allocated
+ * buffer. The buffer is found through the VMA dma->ptr falls in, so it
+ * doesn't matter where it is mapped or whether it was moved or split.
+ * Takes the mmap lock before m_regions_lock, same as mmap(). */
+static int borrow_buffer_pages (struct aclpci_dev *aclpci, struct dma_t *dma) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct mm_struct *mm = aclpci->user_task->mm;
+  struct vm_area_struct *vma;
+  struct dma_buffer *buf = NULL;
+  struct dma_region *r;
+  unsigned long start = (unsigned long)dma->ptr;
+  unsigned long first = 0;
+  int i, found = 0;
+
+  if (mm == NULL) {
+    return 0;
+  }
+
+  aclpci_mmap_read_lock(mm);
+  vma = find_vma (mm, start);
+  if (vma != NULL && vma->vm_start <= start && start + dma->len <= vma->vm_end &&
+      vma->vm_ops == &dma_buffer_vm_ops) {
+    buf = (struct dma_buffer *)vma->vm_private_data;
+    first = ((start - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+  }
+  if (buf != NULL) {
+    mutex_lock(&d->m_regions_lock);
+    for (i = 0; i < ACL_PCIE_DMA_MAX_REGIONS; i++) {
+      r = &(d->m_regions[i]);
+      // vm_pgoff is the handle plus the page the VMA starts at
+      if (r->buf == buf && first > (unsigned long)i && first - (i + 1) < r->num_pages) {
+        slice_region_at (r, dma, first - (i + 1));
+        r->refcount++;
+        found = 1;
+        break;
+      }
+    }
+    mutex_unlock(&d->m_regions_lock);
+  }
+  aclpci_mmap_read_unlock(mm);
+  return found;
+}
+
+
+/* If the transfer is from/to host_buf, a bounce or pool buffer, or
+ * dma->ptr/len falls inside a registered region or a mapped
+ * driver-allocated buffer, point dma at the region's pages instead of
+ * pinning them. Returns 1 if so. */
+static int borrow_region_pages (struct aclpci_dev *aclpci, struct dma_t *dma, struct dma_region *host_buf) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region *r;
+  int i, any_buf = 0;
+
+  mutex_lock(&d->m_regions_lock);
+  if (host_buf != NULL) {
+    r = host_buf;
+    slice_region (r, dma);
+    r->refcount++;
+    mutex_unlock(&d->m_regions_lock);
+    return 1;
+  }
+  for (i = 0; i < ACL_PCIE_DMA_MAX_REGIONS; i++) {
+    r = &(d->m_regions[i]);
+    if (r->buf != NULL) {
+      any_buf |= atomic_read(&r->buf->mmap_count) != 0;
+      continue;
+    }
+    if (r->ptr == NULL) {
+      continue;
+    }
+    if (dma->ptr >= r->ptr &&
+        (unsigned long)dma->ptr + dma->len <= (unsigned long)r->ptr + r->len) {
+      slice_region (r, dma);
+      r->refcount++;
+      mutex_unlock(&d->m_regions_lock);
+      return 1;
+    }
+  }
+  mutex_unlock(&d->m_regions_lock);
+
+  // Only look up the VMA while some driver buffer is mapped
+  return any_buf ? borrow_buffer_pages (aclpci, dma) : 0;
+}
+
+
+#if ACL_DMA_PIN_CACHE
+
+/* Pinned-page cache.
+ *
+ * Windows pinned by lock_dma_buffer() outside of registered buffers are
+ * kept pinned after the transfer and reused by later transfers on the same
+ * pages. An mmu_interval_notifier on every entry marks it stale when the
+ * application unmaps or remaps the range, after which it is no longer
+ * used. An unused entry goes to m_cache_dead right away and is unpinned by
+ * m_unpin_work, one still in use when the last window holding it is done.
+ * Unused entries are unpinned in LRU order to keep the cache under
+ * dma_pin_cache_pages. */
+
+static unsigned int dma_pin_cache_pages = 16384;
+module_param(dma_pin_cache_pages, uint, 0644);
+MODULE_PARM_DESC(dma_pin_cache_pages, "Max number of user pages kept pinned between DMA transfers (0 disables the cache)");
+
+/* Called by the mm with its own locks held. Must not sleep or unpin, so
+ * an unused entry is handed to m_unpin_work instead. */
+static bool cache_invalidate (struct mmu_interval_notifier *mni,
+                              const struct mmu_notifier_range *range,
+                              unsigned long cur_seq)
+{
+  struct dma_region *r = container_of(mni, struct dma_region, notifier);
+  struct aclpci_dma *d = &(r->aclpci->dma_data);
+  int dead = 0;
+
+  spin_lock(&d->m_cache_lock);
+  mmu_interval_set_seq(mni, cur_seq);
+  // Already on its way out if stale and unused. Not in the cache yet
+  // while still being pinned, which can itself invalidate (COW break).
+  if (r->inserted && r->refcount == 0 && !r->stale) {
+    interval_tree_remove(&r->it, &d->m_cache_tree);
+    d->m_cache_pages -= r->num_pages;
+    list_move(&r->lru, &d->m_cache_dead);
+    dead = 1;
+  }
+  r->stale = 1;
+  spin_unlock(&d->m_cache_lock);
+  if (dead) {
+    queue_work(system_unbound_wq, &d->m_unpin_work);
+  }
+  return true;
+}
+
+static const struct mmu_interval_notifier_ops cache_notifier_ops = {
+  .invalidate = cache_invalidate,
+};
+
+/* Unpin an entry already taken out of the tree and the LRU list. */
+static void cache_free_entry (struct dma_region *r) {
+  mmu_interval_notifier_remove(&r->notifier);
+  if (r->extents != NULL) {
+    release_region (r->aclpci, r);
+  }
+  kfree (r);
+}
+
+/* Free the entries on m_cache_dead, stale ones and, oldest first, enough
+ * unused entries to bring the cache down to max_pages. */
+static void cache_shrink (struct aclpci_dma *d, unsigned long max_pages) {
+
+  struct dma_region *r, *tmp;
+  LIST_HEAD(dead);
+
+  spin_lock(&d->m_cache_lock);
+  list_splice_init(&d->m_cache_dead, &dead);
+  list_for_each_entry_safe_reverse(r, tmp, &d->m_cache_lru, lru) {
+    if (r->refcount == 0 && (r->stale || d->m_cache_pages > max_pages)) {
+      interval_tree_remove(&r->it, &d->m_cache_tree);
+      d->m_cache_pages -= r->num_pages;
+      list_move(&r->lru, &dead);
+    }
+  }
+  spin_unlock(&d->m_cache_lock);
+
+  list_for_each_entry_safe(r, tmp, &dead, lru) {
+    cache_free_entry (r);
+  }
+}
+
+/* Same as borrow_region_pages(), for cache entries. */
+static int borrow_cached_pages (struct aclpci_dev *aclpci, struct dma_t *dma) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct interval_tree_node *it;
+  struct dma_region *r;
+  unsigned long start = (unsigned long)dma->ptr;
+  unsigned long last = start + dma->len - 1;
+
+  spin_lock(&d->m_cache_lock);
+  for (it = interval_tree_iter_first(&d->m_cache_tree, start, last); it != NULL;
+       it = interval_tree_iter_next(it, start, last)) {
+    r = container_of(it, struct dma_region, it);
+    if (r->stale || r->mm != aclpci->user_task->mm ||
+        it->start > start || it->last < last) {
+      continue;
+    }
+    // Pinned for a write, now read into: dirty the pages when unpinning
+    if (r->dir != dma->dir) {
+      r->dir = DMA_BIDIRECTIONAL;
+    }
+    slice_region (r, dma);
+    r->refcount++;
+    list_move(&r->lru, &d->m_cache_lru);
+    spin_unlock(&d->m_cache_lock);
+    return 1;
+  }
+  spin_unlock(&d->m_cache_lock);
+  return 0;
+}
+
+/* Start watching the pages dma is about to pin. Must be called before
+ * pinning so that an unmap racing with the pinning is not missed. Returns
+ * NULL if the window won't be cached. */
+static struct dma_region *cache_new_entry (struct aclpci_dev *aclpci, struct dma_t *dma, unsigned long *seq) {
+
+  struct dma_region *r;
+  unsigned long start = (unsigned long)dma->ptr & PAGE_MASK;
+  unsigned long len = (unsigned long)dma->num_pages << PAGE_SHIFT;
+
+  if (dma->num_pages > dma_pin_cache_pages) {
+    return NULL;
+  }
+
+  r = (struct dma_region *)kzalloc ( sizeof(struct dma_region), GFP_KERNEL );
+  if (r == NULL) {
+    return NULL;
+  }
+  r->aclpci = aclpci;
+  r->mm = aclpci->user_task->mm;
+  INIT_LIST_HEAD(&r->lru);
+  if (mmu_interval_notifier_insert(&r->notifier, r->mm, start, len, &cache_notifier_ops) != 0) {
+    kfree (r);
+    return NULL;
+  }
+  *seq = mmu_interval_read_begin(&r->notifier);
+
+  r->ptr = (void *)start;
+  r->len = len;
+  r->it.start = start;
+  r->it.last = start + len - 1;
+  r->cached = 1;
+  return r;
+}
+
+/* Hand the pages just pinned for dma over to entry r, so they stay pinned
+ * after the window is done. The extents were allocated for the entry, not
+ * taken from the window pool, so the pool isn't drained into the cache. */
+static void cache_add_entry (struct aclpci_dev *aclpci, struct dma_t *dma, struct dma_region *r, unsigned long seq) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+
+  r->dir = dma->dir;
+  r->extents = dma->extents;
+  r->num_extents = dma->num_extents;
+  r->sgt = dma->sgt;
+  r->num_pages = dma->num_pages;
+  r->refcount = 1;
+  dma->region = r;
+
+  spin_lock(&d->m_cache_lock);
+  // Unmapped while we were pinning. This window still owns the pages
+  // and they get unpinned when it is done, same as without the cache.
+  r->stale = mmu_interval_read_retry(&r->notifier, seq);
+  interval_tree_insert(&r->it, &d->m_cache_tree);
+  list_add(&r->lru, &d->m_cache_lru);
+  d->m_cache_pages += r->num_pages;
+  r->inserted = 1;
+  spin_unlock(&d->m_cache_lock);
+
+  cache_shrink (d, dma_pin_cache_pages);
+}
+
+#endif // ACL_DMA_PIN_CACHE
+
+
+/* Counterpart of borrow_region_pages() and borrow_cached_pages(). The pages
+ * stay pinned unless the cache entry they belong to went stale. */
+static void return_region_pages (struct aclpci_dev *aclpci, struct dma_t *dma) {
+
+  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct dma_region *r = dma->region;
+
+  memset (dma, 0, sizeof(struct dma_t));
+
+  #if ACL_DMA_PIN_CACHE
+  if (r->cached) {
+    spin_lock(&d->m_cache_lock);
+    r->refcount--;
+    if (r->refcount == 0 && r->stale) {
+      interval_tree_remove(&r->it, &d->m_cache_tree);
+      list_del(&r->lru);
+      d->m_cache_pages -= r->num_pages;
+    } else {
+      r = NULL;
+    }
+    spin_unlock(&d->m_cache_lock);
+    if (r != NULL) {
+      cache_free_entry (r);
+    }
+    return;
+  }
+  #endif
+
+  mutex_lock(&d->m_regions_lock);
+  r->refcount--;
+  mutex_unlock(&d->m_regions_lock);
+}
+
+
+/* Pin-ahead window sizing.
+ *
+ * The next window of a transfer is pinned while the engine works on the
+ * last batch of the current one. While pinning a page is cheaper than
+ * moving it, that pin mostly hides behind the transfer, and larger windows
+ * cut down on calls into GUP and the IOMMU, each with its own overhead
+ * (mmap lock, VMA walk, IOTLB flushes). Once pinning is the slower of the
+ * two, the engine waits for every window anyway, and a large one only
+ * delays the first descriptors and holds more memory pinned. So the window
+ * doubles in the first case and halves in the second, between
+ * dma_win_min_pages and dma_win_max_pages. Transfers smaller than the
+ * window just pin what they need. */
+
+/* Running average over roughly the last 4 samples */
+static u64 cost_average (u64 avg, u64 sample) {
+
+  return (avg == 0) ? sample : (avg * 3 + sample) / 4;
 }
 
+/* Resize the window of c after a new pin cost sample */
+static void adapt_window (struct aclpci_dma_chan *c) {
 
-/* Read/Write large amounts of data using DMA.
- *   dev_addr  -- address on device to read to/write from
- *   dest_addr -- address in user space to read to/write from
- *   len       -- number of bytes to transfer
- *   reading   -- 1 if doing read (from device), 0 if doing write (to device)
- */
-ssize_t aclpci_dma_rw (struct aclpci_dev *aclpci,
-                       void *dev_addr, void __user* user_addr,
-                       ssize_t len, int reading) {
-
-  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: %sing %lu bytes", reading ? "Read" : "Writ", len);
-  if (reading) {
-    read_write (aclpci, dev_addr,  user_addr, len, reading);
+  if (c->m_pin_ns == 0 || c->m_drain_ns == 0) {
+    return;
+  }
+  if (c->m_pin_ns < c->m_drain_ns) {
+    if (c->m_win_pages < dma_win_max_pages) {
+      c->m_win_pages *= 2;
+    }
   } else {
-    read_write (aclpci, user_addr,  dev_addr, len, reading);
+    c->m_win_pages /= 2;
   }
-
-  return 0;
 }
 
+/* Bytes to pin for the next window of c's transfer, which has remaining
+ * bytes left from c->m_host_addr. The active and the pre-pinned window are
+ * pinned together, so both have to fit in the user's RLIMIT_MEMLOCK, but
+ * dma_win_min_pages is always allowed. Windows that don't reach the end of
+ * the transfer end on a page boundary. */
+static size_t window_bytes (struct aclpci_dev *aclpci, struct aclpci_dma_chan *c, size_t remaining) {
 
-/* Return idle status of the DMA hardware. */
-int aclpci_dma_get_idle_status(struct aclpci_dev *aclpci) {
-  return aclpci->dma_data.m_idle;
+  unsigned long limit = RLIM_INFINITY;
+  unsigned int pages = c->m_win_pages;
+  size_t bytes;
+
+  if (aclpci->user_task != NULL) {
+    limit = task_rlimit(aclpci->user_task, RLIMIT_MEMLOCK);
+  }
+  if (limit != RLIM_INFINITY && pages > (limit >> PAGE_SHIFT) / 2) {
+    pages = (limit >> PAGE_SHIFT) / 2;
+  }
+  if (pages > dma_win_max_pages) {
+    pages = dma_win_max_pages;
+  }
+  if (pages < dma_win_min_pages) {
+    pages = dma_win_min_pages;
+  }
+  if (pages == 0) {
+    pages = 1;
+  }
+  c->m_win_pages = pages;
+
+  bytes = ((size_t)pages << PAGE_SHIFT) - ((unsigned long)c->m_host_addr & (PAGE_SIZE - 1));
+  return (remaining > bytes) ? bytes : remaining;
 }
 
 
-int lock_dma_buffer (struct aclpci_dev *aclpci, void *addr, ssize_t len, struct pinned_mem *active_mem) {
+int lock_dma_buffer (struct aclpci_dev *aclpci, int reading, void *addr, ssize_t len, struct pinned_mem *active_mem) {
 
   int ret;
   unsigned int num_act_pages;
-  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
   ssize_t start_page, end_page, num_pages;
   u64 ej, startj = get_jiffies_64();
+  u64 pin_start;
   struct dma_t *dma = &(active_mem->dma);
 
-  #if MAP_UNMAP_PAGES
-  unsigned int i;
-  dma_addr_t phys;
+  #if ACL_DMA_PIN_CACHE
+  struct dma_region *entry;
+  unsigned long seq;
   #endif
 
+  struct aclpci_dma *d = &(aclpci->dma_data);
+
   dma->ptr = addr;
   dma->len = len;
-  dma->dir = d->m_read ? PCI_DMA_FROMDEVICE : PCI_DMA_TODEVICE;
+  dma->dir = reading ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
   /* num_pages that [addr, addr+len] map to. */
   start_page = (ssize_t)addr >> PAGE_SHIFT;
   end_page = ((ssize_t)addr + len - 1) >> PAGE_SHIFT;
   num_pages = end_page - start_page + 1;
 
   dma->num_pages = num_pages;
-  dma->pages = (struct page**)kzalloc ( sizeof(struct page*) * dma->num_pages, GFP_KERNEL );
-  if (dma->pages == NULL) {
-    ACL_DEBUG (KERN_WARNING "Couldn't allocate array of %u ptrs!", dma->num_pages);
-    return -EFAULT;
+  dma->first_page = 0;
+  dma->region = NULL;
+
+  /* Pages of a registered buffer are already pinned and mapped */
+  if (borrow_region_pages (aclpci, dma, c->m_host_buf)) {
+    ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: Using registered buffer at 0x%p for %lu pages", dma->region->ptr, num_pages);
+    goto set_window;
   }
 
-  dma->dma_addrs = (dma_addr_t*)kzalloc ( sizeof(dma_addr_t) * dma->num_pages, GFP_KERNEL );
-  if (dma->dma_addrs == NULL) {
-    ACL_DEBUG (KERN_WARNING "Couldn't allocate array of %u dma_addr_t's!", dma->num_pages);
-    return -EFAULT;
+  #if ACL_DMA_PIN_CACHE
+  if (borrow_cached_pages (aclpci, dma)) {
+    ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: Pinned-page cache hit at 0x%p for %lu pages", addr, num_pages);
+    goto set_window;
   }
-  ACL_VERBOSE_DEBUG (KERN_DEBUG "pages = [%p, %p), dma_addrs = [%p, %p)",
-                     dma->pages, dma->pages+num_pages, dma->dma_addrs, dma->dma_addrs+num_pages);
+  #endif
+
+  #if ACL_DMA_PIN_CACHE
+  entry = cache_new_entry (aclpci, dma, &seq);
+  #endif
 
-  /* pin user memory and get set of physical pages back in 'p' ptr. */
-  ret = aclpci_get_user_pages(aclpci->user_task, (unsigned long)addr & PAGE_MASK, num_pages, dma->pages);
+  /* pin user memory and collect the physical pages into extents. */
+  pin_start = ktime_get_ns();
+  #if ACL_DMA_PIN_CACHE
+  ret = pin_user_extents (aclpci, (unsigned long)addr & PAGE_MASK, num_pages, c->m_pin_pages, entry == NULL,
+                          &dma->extents, &dma->num_extents);
+  // Past RLIMIT_MEMLOCK, let go of the unused entries and pin this window
+  // for the transfer only, which isn't held to the limit
+  if (ret == -ENOMEM && entry != NULL) {
+    cache_free_entry (entry);
+    entry = NULL;
+    cache_shrink (d, 0);
+    ret = pin_user_extents (aclpci, (unsigned long)addr & PAGE_MASK, num_pages, c->m_pin_pages, 1,
+                            &dma->extents, &dma->num_extents);
+  }
+  #else
+  ret = pin_user_extents (aclpci, (unsigned long)addr & PAGE_MASK, num_pages, c->m_pin_pages, 1,
+                          &dma->extents, &dma->num_extents);
+  #endif
   if (ret != 0) {
     ACL_DEBUG (KERN_WARNING "Couldn't pin all user pages. %d!\n", ret);
+    #if ACL_DMA_PIN_CACHE
+    if (entry != NULL) {
+      cache_free_entry (entry);
+    }
+    #endif
+    // A NULL ptr is what tells the channel there is no window here
+    memset (dma, 0, sizeof(struct dma_t));
     return -EFAULT;
   }
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA: %lu pages in %u extents", num_pages, dma->num_extents);
 
 
   /* map pages for PCI access. */
   num_act_pages = 0;
-  #if MAP_UNMAP_PAGES
-
-  for (i = 0; i < dma->num_pages; i++) {
-    struct page *cur = dma->pages[i];
-    // ACL_DEBUG (KERN_DEBUG "p[%d] = 0x%p", i, cur);
-    if (cur != NULL) {
-      // ACL_DEBUG (KERN_DEBUG "  phys_addr = 0x%llx", page_to_phys(cur));
-      phys = pci_map_page (d->m_pci_dev, cur, 0, PAGE_SIZE, dma->dir);
-      if (phys == 0) {
-        ACL_DEBUG (KERN_DEBUG "  Couldn't pci_map_page!");
-        return -EFAULT;
-      }
-      dma->dma_addrs[i] = phys;
-      num_act_pages++;
+  if (map_extents (d, dma->extents, dma->num_extents, &dma->sgt) != 0) {
+    #if ACL_DMA_PIN_CACHE
+    if (entry != NULL) {
+      cache_free_entry (entry);
     }
+    #endif
+    aclpci_release_user_extents (aclpci->user_task, dma->extents, dma->num_extents, 0);
+    free_extents (&(aclpci->dma_data), dma->extents);
+    memset (dma, 0, sizeof(struct dma_t));
+    return -EFAULT;
+  }
+  num_act_pages = num_pages;
+
+  if (num_pages >= ACL_PCIE_DMA_MIN_SAMPLE_PAGES) {
+    c->m_pin_ns = cost_average (c->m_pin_ns, div64_u64(ktime_get_ns() - pin_start, num_pages));
+    adapt_window (c);
+  }
+
+  #if ACL_DMA_PIN_CACHE
+  if (entry != NULL) {
+    cache_add_entry (aclpci, dma, entry, seq);
   }
   #endif
+  goto set_window_mapped;
+
+set_window:
+  // Mapping the pages synced them, borrowed ones have to be synced here
+  sync_window (d, dma, 0);
 
+set_window_mapped:
   active_mem->pages_rem = dma->num_pages;
-  active_mem->next_page = dma->pages;
-  active_mem->next_dma_addr = dma->dma_addrs;
+  active_mem->next_extent = dma->extents;
+  active_mem->next_extent_page = dma->first_page;
   active_mem->first_page_offset = (unsigned long)addr & (PAGE_SIZE - 1);
   active_mem->last_page_offset = (unsigned long)(addr + len) & (PAGE_SIZE - 1);
 
   //ACL_DEBUG (KERN_DEBUG  "Content of first page (addr  = %p): %s",
-  //             page_to_phys(dma->pages[0]), (char*)phys_to_virt(page_to_phys(dma->pages[0])));
+  //             page_to_phys(dma->extents[0].page), (char*)phys_to_virt(page_to_phys(dma->extents[0].page)));
   ej = get_jiffies_64();
 
   ACL_VERBOSE_DEBUG (KERN_DEBUG  "DMA: Pinned %u bytes (%lu pages) at 0x%p in %u usec",
@@ -368,48 +2369,93 @@ int lock_dma_buffer (struct aclpci_dev *aclpci, void *addr, ssize_t len, struct
   ACL_VERBOSE_DEBUG (KERN_DEBUG  "DMA: first page offset is %u, last page offset is %u",
          active_mem->first_page_offset, active_mem->last_page_offset);
 
-  d->m_pin_time += (ej - startj);
-  d->m_lock_time += (ej - startj);
+  c->m_pin_time += (ej - startj);
+  c->m_lock_time += (ej - startj);
   return 0;
 }
 
 
-void unlock_dma_buffer (struct aclpci_dev *aclpci, struct dma_t *dma) {
+/* Unpin everything handed to defer_unpin() so far, and the cache entries
+ * the notifier found unmapped */
+static void unpin_work_func (struct work_struct *work) {
+
+  struct aclpci_dma *d = container_of(work, struct aclpci_dma, m_unpin_work);
+  struct deferred_unpin *u, *tmp;
+  LIST_HEAD(batch);
+
+  spin_lock(&d->m_unpin_lock);
+  list_splice_init(&d->m_unpin_list, &batch);
+  spin_unlock(&d->m_unpin_lock);
+
+  list_for_each_entry_safe(u, tmp, &batch, list) {
+    aclpci_release_user_extents (d->m_aclpci->user_task, u->extents, u->num_extents, u->dirty);
+    if (win_pool_index(d, u->extents) >= 0) {
+      free_extents (d, u->extents);
+    } else {
+      kfree (u->extents);
+      kfree (u);
+    }
+  }
+
+#if ACL_DMA_PIN_CACHE
+  cache_shrink (d, ULONG_MAX);
+#endif
+}
+
+/* Unpin extents and free the array later, off the DMA path. The pages have
+ * to be unmapped already, so the CPU sees what the device wrote. Falls back
+ * to unpinning right away if out of memory. */
+static void defer_unpin (struct aclpci_dev *aclpci, struct dma_extent *extents, unsigned int num_extents, int dirty) {
 
   struct aclpci_dma *d = &(aclpci->dma_data);
-  u64 ej, startj = get_jiffies_64();
+  struct deferred_unpin *u;
+  int i, first;
+
+  // Pooled windows carry their own node
+  i = win_pool_index(d, extents);
+  if (i >= 0) {
+    u = &(d->m_win_pool[i]->unpin);
+  } else {
+    u = (struct deferred_unpin *)kmalloc (sizeof(struct deferred_unpin), GFP_KERNEL);
+  }
+  if (u == NULL) {
+    aclpci_release_user_extents (aclpci->user_task, extents, num_extents, dirty);
+    kfree (extents);
+    return;
+  }
+  u->extents = extents;
+  u->num_extents = num_extents;
+  u->dirty = dirty;
+
+  // Only kick the worker for the first window of a batch
+  spin_lock(&d->m_unpin_lock);
+  first = list_empty(&d->m_unpin_list);
+  list_add_tail(&u->list, &d->m_unpin_list);
+  spin_unlock(&d->m_unpin_lock);
+  if (first) {
+    queue_work(system_unbound_wq, &d->m_unpin_work);
+  }
+}
 
-  #if DEBUG_UNLOCK_PAGES
-  char *s = (char*)phys_to_virt(page_to_phys(dma->pages[0]));
 
-  ACL_DEBUG (KERN_DEBUG  "1. Content of first page (addr  = %p): %s",
-               page_to_phys(dma->pages[0]), s);
-  #endif
+void unlock_dma_buffer (struct aclpci_dev *aclpci, int reading, struct dma_t *dma) {
 
-  #if MAP_UNMAP_PAGES
-  int i;
-  /* Unmap pages to make the data available for CPU */
-  for (i = 0; i < dma->num_pages; i++) {
-    struct page *cur = dma->pages[i];
-    // ACL_DEBUG (KERN_DEBUG "p[%d] = %p", i, cur);
-    if (cur != NULL) {
-      dma_addr_t phys = dma->dma_addrs[i];
-      pci_unmap_page (d->m_pci_dev, phys, PAGE_SIZE, dma->dir);
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+  u64 ej, startj = get_jiffies_64();
+
+  if (dma->region != NULL) {
+    if (dma->dir != DMA_TO_DEVICE) {
+      sync_window (&(aclpci->dma_data), dma, 1);
     }
+    return_region_pages (aclpci, dma);
+    return;
   }
-  #endif
-
-  // TODO: If do map/unmap for reads, the data is 0 by now!!!!
-  #if DEBUG_UNLOCK_PAGES
-    ACL_DEBUG (KERN_DEBUG  "2. Content of first page: %s", s);
-  #endif
 
-  /* Unpin pages */
-  aclpci_release_user_pages (aclpci->user_task, dma->pages, dma->num_pages);
+  /* Unmap pages to make the data available for CPU */
+  unmap_extents (&(aclpci->dma_data), dma->extents, &dma->sgt);
 
-  /* TODO: try to re-use these buffers on future allocs */
-  kfree (dma->pages);
-  kfree (dma->dma_addrs);
+  /* Unpin pages. Only dirty them if the device wrote to them. */
+  defer_unpin (aclpci, dma->extents, dma->num_extents, dma->dir != DMA_TO_DEVICE);
 
   ej = get_jiffies_64();
   ACL_VERBOSE_DEBUG (KERN_DEBUG  "DMA: Unpinned %u pages in %u usec",
@@ -419,25 +2465,25 @@ void unlock_dma_buffer (struct aclpci_dev *aclpci, struct dma_t *dma) {
   /* Reset all dma fields. */
   memset (dma, 0, sizeof(struct dma_t));
 
-  d->m_pin_time += (ej - startj);
-  d->m_unlock_time += (ej - startj);
+  c->m_pin_time += (ej - startj);
+  c->m_unlock_time += (ej - startj);
 }
 
-void unlock_all_dma(struct aclpci_dev *aclpci)
+void unlock_all_dma(struct aclpci_dev *aclpci, int reading)
 {
-  struct aclpci_dma *d = &(aclpci->dma_data);
-  struct dma_t *dma = &(d->m_active_mem.dma);
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+  struct dma_t *dma = &(c->m_active_mem.dma);
 
-  if (d->m_active_mem.dma.ptr != NULL) {
-    unlock_dma_buffer (aclpci, dma);
+  if (c->m_active_mem.dma.ptr != NULL) {
+    unlock_dma_buffer (aclpci, reading, dma);
   }
-  dma = &(d->m_pre_pinned_mem.dma);
-  if (d->m_pre_pinned_mem.dma.ptr != NULL) {
-    unlock_dma_buffer (aclpci, dma);
+  dma = &(c->m_pre_pinned_mem.dma);
+  if (c->m_pre_pinned_mem.dma.ptr != NULL) {
+    unlock_dma_buffer (aclpci, reading, dma);
   }
-  dma = &(d->m_done_mem.dma);
-  if (d->m_done_mem.dma.ptr != NULL) {
-    unlock_dma_buffer (aclpci, dma);
+  dma = &(c->m_done_mem.dma);
+  if (c->m_done_mem.dma.ptr != NULL) {
+    unlock_dma_buffer (aclpci, reading, dma);
   }
 
 }
@@ -477,70 +2523,77 @@ static int set_desc_table_header(struct dma_desc_header *header)
     return 0;
 }
 
+/* Hand descriptors up to last_id to the engine. The descriptor table and
+ * the on-chip FIFO are only set up when first is 0, i.e. once per session.
+ * After that the table is a ring and moving the last pointer is enough,
+ * including when it wraps around past the end of the table. */
 void send_dma_desc(struct aclpci_dev *aclpci, int reading, int first, int last_id)
 {
-  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
   void *dma_desc_base = get_dma_desc_offset(aclpci);
-  // TODO: int first is from get_start_id function. Right now always set to 0.
-  // When the last pointer loops back to 0, we don't have to write the FIFO address for some reason
   ACL_VERBOSE_DEBUG (KERN_DEBUG "Set desc table\n");
+  c->m_us_valid = 1;
+  ktime_get_ts64(&(c->m_us_dma_start_time));
   if (reading) {
-    iowrite32 ((dma_addr_t)d->desc_table_wr_bus_addr, dma_desc_base+ACL_PCIE_DMA_RC_WR_DESC_BASE_LOW);
-    iowrite32 (((dma_addr_t)d->desc_table_wr_bus_addr)>>32, dma_desc_base+ACL_PCIE_DMA_RC_WR_DESC_BASE_HIGH);
     if (first == 0) {
       ACL_VERBOSE_DEBUG (KERN_DEBUG "Set EP registers\n");
+      iowrite32 ((dma_addr_t)c->desc_table_bus_addr, dma_desc_base+ACL_PCIE_DMA_RC_WR_DESC_BASE_LOW);
+      iowrite32 (((dma_addr_t)c->desc_table_bus_addr)>>32, dma_desc_base+ACL_PCIE_DMA_RC_WR_DESC_BASE_HIGH);
       wmb();
       iowrite32 (ACL_PCIE_DMA_ONCHIP_WR_FIFO_BASE_LO, dma_desc_base+ACL_PCIE_DMA_EP_WR_FIFO_BASE_LOW);
       iowrite32 (ACL_PCIE_DMA_ONCHIP_WR_FIFO_BASE_HI, dma_desc_base+ACL_PCIE_DMA_EP_WR_FIFO_BASE_HIGH);
       iowrite32 (ACL_PCIE_DMA_TABLE_SIZE-1, dma_desc_base+ACL_PCIE_DMA_WR_TABLE_SIZE);
       // Add this for debug. Setting DMA control register to 1 makes it write 1 to all dma table status entry
       // iowrite32 (1, dma_desc_base+ACL_PCIE_DMA_WR_CONTROL);
+      c->m_ring_ready = 1;
     }
     wmb();
-    d->dma_wr_last_id = last_id;
+    c->last_id = last_id;
     iowrite32 (last_id, dma_desc_base+ACL_PCIE_DMA_WR_LAST_PTR);
   } else {
-    iowrite32 ((dma_addr_t)d->desc_table_rd_bus_addr, dma_desc_base+ACL_PCIE_DMA_RC_RD_DESC_BASE_LOW);
-    iowrite32 (((dma_addr_t)d->desc_table_rd_bus_addr)>>32, dma_desc_base+ACL_PCIE_DMA_RC_RD_DESC_BASE_HIGH);
     if (first == 0) {
       ACL_VERBOSE_DEBUG (KERN_DEBUG "Set EP registers\n");
+      iowrite32 ((dma_addr_t)c->desc_table_bus_addr, dma_desc_base+ACL_PCIE_DMA_RC_RD_DESC_BASE_LOW);
+      iowrite32 (((dma_addr_t)c->desc_table_bus_addr)>>32, dma_desc_base+ACL_PCIE_DMA_RC_RD_DESC_BASE_HIGH);
       wmb();
       iowrite32 (ACL_PCIE_DMA_ONCHIP_RD_FIFO_BASE_LO, dma_desc_base+ACL_PCIE_DMA_EP_RD_FIFO_BASE_LOW);
       iowrite32 (ACL_PCIE_DMA_ONCHIP_RD_FIFO_BASE_HI, dma_desc_base+ACL_PCIE_DMA_EP_RD_FIFO_BASE_HIGH);
       iowrite32 (ACL_PCIE_DMA_TABLE_SIZE-1, dma_desc_base+ACL_PCIE_DMA_RD_TABLE_SIZE);
       // Add this for debug. Setting DMA control register to 1 makes it write 1 to all dma table status entry
       //iowrite32 (1, dma_desc_base+ACL_PCIE_DMA_RD_CONTROL);
+      c->m_ring_ready = 1;
     }
     wmb();
-    d->dma_rd_last_id = last_id;
+    c->last_id = last_id;
     iowrite32 (last_id, dma_desc_base+ACL_PCIE_DMA_RD_LAST_PTR);
   }
 }
 
+/* Ring slot of the descriptor n places after start */
+static inline int ring_index (int start, int n)
+{
+  return (start + n) % ACL_PCIE_DMA_TABLE_SIZE;
+}
+
+/* Slot of the first descriptor of the next batch, right after the last one
+ * the engine was given, or after the staged batch if there is one. first
+ * is 0 if the ring still has to be set up. */
 int get_start_id (struct aclpci_dev *aclpci, int reading, int *start_id, int *first) {
-  struct aclpci_dma *d = &(aclpci->dma_data);
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
   int check_last_id;
 
-  if (reading) {
-    check_last_id = d->dma_wr_last_id;
-    set_desc_table_header(&d->desc_table_wr_cpu_virt_addr->header);
-  } else {
-    check_last_id = d->dma_rd_last_id;
-    set_desc_table_header(&d->desc_table_rd_cpu_virt_addr->header);
+  check_last_id = c->last_id;
+  if (c->m_staged_last_id != ACL_PCIE_DMA_RESET_ID) {
+    check_last_id = c->m_staged_last_id;
   }
   ACL_VERBOSE_DEBUG (KERN_DEBUG "check_last_id = %i", check_last_id);
 
-  // TODO: first can be changed to 1 for check_last_id==ACL_PCIE_DMA_TABLE_SIZE - 1 to optimize DMA behaviour
-  //       Safer to leave it at 0 for now though.
   if (check_last_id == ACL_PCIE_DMA_RESET_ID) {
     *start_id = 0;
     *first = 0;
-  } else if (check_last_id == ACL_PCIE_DMA_TABLE_SIZE - 1) {
-    *start_id = 0;
-    *first = 0;
-  } else if (check_last_id < ACL_PCIE_DMA_TABLE_SIZE - 1) {
-    *start_id = check_last_id + 1;
-    *first = 0;
+  } else if (check_last_id < ACL_PCIE_DMA_TABLE_SIZE) {
+    *start_id = ring_index(check_last_id, 1);
+    *first = c->m_ring_ready;
   } else {
     ACL_DEBUG (KERN_WARNING "WARNING :: Unrecognized last id %i", check_last_id);
     return 1;
@@ -548,268 +2601,287 @@ int get_start_id (struct aclpci_dev *aclpci, int reading, int *start_id, int *fi
   return 0;
 }
 
-int non_aligned_page_handler
+/* Give the batch of descriptors from start_id to last_id to the engine. If
+ * the engine is still busy with the previous batch, keep it staged instead,
+ * and aclpci_dma_update() starts it as soon as that one is done. */
+static void submit_batch (struct aclpci_dev *aclpci, int reading, int start_id, int first, int last_id,
+                          unsigned int pages)
+{
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+  int i;
+
+  // Only batches large enough to say something about the transfer rate
+  if (pages < ACL_PCIE_DMA_MIN_SAMPLE_PAGES) {
+    pages = 0;
+  }
+
+  // Only clear this batch's status. The batch in flight may be writing its own.
+  for (i = start_id; i != ring_index(last_id, 1); i = ring_index(i, 1)) {
+    c->desc_table->header.flags[i] = cpu_to_le32(0x0);
+  }
+
+  if (c->m_in_flight) {
+    ACL_VERBOSE_DEBUG (KERN_DEBUG "Staging descriptors %i to %i", start_id, last_id);
+    c->m_staged_first = first;
+    c->m_staged_last_id = last_id;
+    c->m_staged_pages = pages;
+  } else {
+    c->m_in_flight = 1;
+    c->m_flight_pages = pages;
+    c->m_flight_stamp = ktime_get_ns();
+    send_dma_desc(aclpci, reading, first, last_id);
+  }
+}
+
+/* Bus address of the next page of the window */
+static dma_addr_t window_page_addr (struct pinned_mem *pm)
+{
+  return pm->next_extent->dma_addr + ((dma_addr_t)pm->next_extent_page << PAGE_SHIFT);
+}
+
+/* Move the window n pages forward, across extents as needed */
+static void window_advance (struct pinned_mem *pm, unsigned int n)
+{
+  struct dma_extent *end = pm->dma.extents + pm->dma.num_extents;
+
+  pm->next_extent_page += n;
+  while (pm->next_extent < end && pm->next_extent_page >= pm->next_extent->num_pages) {
+    pm->next_extent_page -= pm->next_extent->num_pages;
+    pm->next_extent++;
+  }
+}
+
+/* Number of pages with consecutive bus addresses from the window's next
+ * page on: to the end of its extent, and on through the following extents
+ * the IOMMU mapped right after it. Never more than max_pages or than what
+ * fits in one descriptor. */
+static unsigned int window_run (struct pinned_mem *pm, unsigned int max_pages)
+{
+  struct dma_extent *e = pm->next_extent;
+  struct dma_extent *end = pm->dma.extents + pm->dma.num_extents;
+  unsigned int n = e->num_pages - pm->next_extent_page;
+
+  while (n < max_pages && e + 1 < end &&
+         e[1].dma_addr == e->dma_addr + ((dma_addr_t)e->num_pages << PAGE_SHIFT)) {
+    e++;
+    n += e->num_pages;
+  }
+
+  if (max_pages > ACL_PCIE_DMA_DESC_MAX_PAGES) {
+    max_pages = ACL_PCIE_DMA_DESC_MAX_PAGES;
+  }
+  return (n < max_pages) ? n : max_pages;
+}
+
+/* Build descriptors for a partial page, at the start of the window or at
+ * the end of the transfer, as power-of-two pieces of up to
+ * 2^ACL_PCIE_DMA_NON_ALIGNED_TRANS_LOG bytes. The pieces go into the ring
+ * from start_id + n on, so they can share a batch with other descriptors,
+ * and the batch is left for the caller to submit. If the batch fills up,
+ * the rest of the page is left for the next one.
+ * Returns the new number of descriptors in the batch, or -1 on error. */
+static int non_aligned_page_handler
 (
   struct aclpci_dev *aclpci,
   dma_addr_t pcie_addr,
   u64 qsys_addr,
   size_t bytes,
-  int reading
+  int reading,
+  int start_id,
+  int n
 )
 {
-  struct aclpci_dma *d = &(aclpci->dma_data);
-  struct page *next_page;
-  size_t transfer_bytes_w, remaining, temp, transfer_bytes, transferred, transfer_words;
-  int result, i, last_id, max_transfer, start_id, first;
+  struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+  size_t transfer_bytes, transferred;
+  unsigned int transfer_bytes_w;
+  int i;
 
   if (bytes >= PAGE_SIZE) {
     ACL_DEBUG(KERN_WARNING "WARNING :: non aligned handler asked to transfer %u bytes. Max is %u", (unsigned int) bytes, (unsigned int) PAGE_SIZE);
-    return 1;
-  }
-
-  remaining = bytes;
-  last_id = ACL_PCIE_DMA_RESET_ID;
-
-  first = 0;
-
-  result = get_start_id(aclpci, reading, &start_id, &first);
-  if (result != 0) {
-    ACL_DEBUG(KERN_WARNING "WARNING :: Failed get start id");
-    return 1;
+    return -1;
   }
-  max_transfer = ACL_PCIE_DMA_TABLE_SIZE - start_id;
 
+  transferred = 0;
   for (transfer_bytes_w = ACL_PCIE_DMA_NON_ALIGNED_TRANS_LOG; transfer_bytes_w > 1; transfer_bytes_w--) {
-    temp = remaining >> transfer_bytes_w;
-    transfer_bytes = 1 << transfer_bytes_w;
-    transfer_words = transfer_bytes/4;
-
-    // Sanity check.
-    // When PAGE_SIZE <= 4096 and ACL_PCIE_DMA_NON_ALIGNED_TRANS_LOG >= 11,
-    // Non-aligned page handler transfers 1 descriptor at a time with size 2048 -> 1024 -> 512 -> ... -> 4
-    // So temp is never greater than 1.
-    if (PAGE_SIZE <= 4096 && ACL_PCIE_DMA_NON_ALIGNED_TRANS_LOG >= 11 && temp > 1) {
-      ACL_DEBUG(KERN_WARNING "WARNING :: non aligned handler transferring %u with max at %i", (unsigned int)temp, max_transfer);
-      return 1;
-    }
-
-    if (temp >= max_transfer) {
-      for (i = 0; i < max_transfer; i++) {
-        if (reading) {
-          set_write_desc(&d->desc_table_wr_cpu_virt_addr->descriptors[i+start_id], (u64)qsys_addr + i*transfer_bytes, (dma_addr_t)pcie_addr + i*transfer_bytes, transfer_words, i+start_id);
-        } else {
-          set_read_desc(&d->desc_table_rd_cpu_virt_addr->descriptors[i+start_id], (dma_addr_t)pcie_addr + i*transfer_bytes, (u64)qsys_addr + i*transfer_bytes, transfer_words, i+start_id);
-        }
-        ACL_VERBOSE_DEBUG (KERN_DEBUG "Building descriptor :: Transferring %u bytes :: pcie addr %llx%llx :: qsys addr %llx%llx :: descriptor %i", (unsigned int)transfer_bytes, (u64) (pcie_addr + i*transfer_bytes) >> 32, (u64) (pcie_addr + i*transfer_bytes) & 0xffffffff, (u64) (qsys_addr + i*transfer_bytes) >> 32, (u64) (qsys_addr + i*transfer_bytes) & 0xffffffff, i+start_id);
-      }
-      transferred = transfer_bytes*max_transfer;
-      last_id = ACL_PCIE_DMA_TABLE_SIZE - 1;
-      ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA Transfering page unaligned %u bytes",
-                  (unsigned int)transfer_bytes*max_transfer);
-      break;
-    } else if (temp > 0) {
-      for (i = 0; i < temp; i++) {
-        if (reading) {
-          set_write_desc(&d->desc_table_wr_cpu_virt_addr->descriptors[i+start_id], (u64)qsys_addr + i*transfer_bytes, (dma_addr_t)pcie_addr + i*transfer_bytes, transfer_words, i+start_id);
-        } else {
-          set_read_desc(&d->desc_table_rd_cpu_virt_addr->descriptors[i+start_id], (dma_addr_t)pcie_addr + i*transfer_bytes, (u64)qsys_addr + i*transfer_bytes, transfer_words, i+start_id);
-        }
-        ACL_VERBOSE_DEBUG (KERN_DEBUG "Building descriptor :: Transferring %u bytes :: pcie addr %llx%llx :: qsys addr %llx%llx :: descriptor %i", (unsigned int)transfer_bytes, (u64) (pcie_addr + i*transfer_bytes) >> 32, (u64) (pcie_addr + i*transfer_bytes) & 0xffffffff, (u64) (qsys_addr + i*transfer_bytes) >> 32, (u64) (qsys_addr + i*transfer_bytes) & 0xffffffff, i+start_id);
+    transfer_bytes = (size_t)1 << transfer_bytes_w;
+    while (bytes - transferred >= transfer_bytes && n < ACL_PCIE_DMA_RING_MAX_BATCH) {
+      i = ring_index(start_id, n);
+      if (reading) {
+        set_write_desc(&c->desc_table->descriptors[i], qsys_addr + transferred, pcie_addr + transferred, transfer_bytes/4, i);
+      } else {
+        set_read_desc(&c->desc_table->descriptors[i], pcie_addr + transferred, qsys_addr + transferred, transfer_bytes/4, i);
       }
-      transferred = transfer_bytes*temp;
-      last_id = start_id + temp - 1;
-      ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA Transfering page unaligned %u bytes",
-                  (unsigned int)transfer_bytes*temp);
-      break;
+      ACL_VERBOSE_DEBUG (KERN_DEBUG "Building descriptor :: Transferring %u bytes :: pcie addr %llx%llx :: qsys addr %llx%llx :: descriptor %i", (unsigned int)transfer_bytes, (u64) (pcie_addr + transferred) >> 32, (u64) (pcie_addr + transferred) & 0xffffffff, (u64) (qsys_addr + transferred) >> 32, (u64) (qsys_addr + transferred) & 0xffffffff, i);
+      transferred += transfer_bytes;
+      n++;
     }
   }
-  if (last_id == ACL_PCIE_DMA_RESET_ID) {
+  if (transferred == 0) {
     ACL_DEBUG(KERN_WARNING "DMA non-aligned transfer failed");
-    return 1;
+    return -1;
   }
-  send_dma_desc(aclpci, reading, first, last_id);
-
-  d->m_device_addr += transferred;
-  d->m_bytes_sent += transferred;
-  d->m_host_addr += transferred;
-  d->m_active_mem.first_page_offset += transferred;
-  remaining -= transferred;
-
-  if (d->m_done_mem.dma.ptr != NULL) {
-    unlock_dma_buffer (aclpci, &(d->m_done_mem.dma));
-  }
-  if (remaining == 0) {
-    d->m_active_mem.first_page_offset = 0;
-    ++d->m_active_mem.next_page;
-    ++d->m_active_mem.next_dma_addr;
-    d->m_active_mem.pages_rem--;
-    next_page = *(d->m_active_mem.next_page);
-    d->m_cur_dma_addr = page_to_phys (next_page);
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "DMA Transfering page unaligned %u bytes", (unsigned int)transferred);
+
+  c->m_device_addr += transferred;
+  c->m_bytes_sent += transferred;
+  c->m_host_addr += transferred;
+  c->m_active_mem.first_page_offset += transferred;
+
+  if (transferred == bytes) {
+    c->m_active_mem.first_page_offset = 0;
+    window_advance (&c->m_active_mem, 1);
+    c->m_active_mem.pages_rem--;
+    if (c->m_active_mem.pages_rem > 0) {
+      c->m_cur_dma_addr = window_page_addr (&c->m_active_mem);
+    }
   }
 
-  return 0;
+  return n;
 }
 
-// Return 1 if something was done. 0 otherwise.
-int aclpci_dma_update (struct aclpci_dev *aclpci, int forced)
+/* Build the next batch of descriptors of the current transfer, pinning
+ * memory as needed, and hand it to submit_batch().
+ * Returns 1 if a batch was built, 0 if there was nothing to do. */
+static int build_batch (struct aclpci_dev *aclpci, int reading)
 {
-   struct aclpci_dma *d = &(aclpci->dma_data);
-   struct dma_t *dma = &(d->m_active_mem.dma);
-   struct page *next_page;
+   struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+   struct dma_t *dma = &(c->m_active_mem.dma);
 
    size_t remaining, lock_size;
    u32 first;
    unsigned int first_size, single_page;
-   int i, max_transfer, start_id, last_id, reading, result = 1;
-
-   u64 ej;
+   unsigned int pages_left, pages_sent, run;
+   size_t run_bytes;
+   int i, n, max_transfer, start_id, last_id, result = 1;
 
-   reading = d->m_read;
-
-   remaining = d->m_bytes - d->m_bytes_sent;
+   remaining = c->m_bytes - c->m_bytes_sent;
    max_transfer = 0;
 
-   // DMA transaction complete. Reset values and return.
-   if (remaining == 0) {
-     d->dma_wr_last_id = ACL_PCIE_DMA_RESET_ID;
-     d->dma_rd_last_id = ACL_PCIE_DMA_RESET_ID;
-     d->m_page_last_id = ACL_PCIE_DMA_TABLE_SIZE-1;
-
-     unlock_dma_buffer (aclpci, dma);
-     if (d->m_done_mem.dma.ptr != NULL) {
-        unlock_dma_buffer (aclpci, &(d->m_done_mem.dma));
-      }
-
-     ACL_VERBOSE_DEBUG (KERN_DEBUG "Done DMA for device_addr: %llx host_addr: %llx reading: %i bytes: %u\n", (u64)d->m_device_addr, (u64)d->m_host_addr, reading, (unsigned int) d->m_bytes);
-
-     ej = get_jiffies_64();
-     ACL_VERBOSE_DEBUG (KERN_DEBUG "Spent %u msec %sing %u bytes", jiffies_to_msecs(ej - d->m_start_time),
-                           reading ? "read" : "writ", (unsigned int) d->m_bytes);
-
-     // Interrupt to MMD layer for DMA done
-     d->m_idle = 1;
-
-     if(aclpci->user_task != NULL) {
-           if( send_sig_info(aclpci->signal_number, &aclpci->signal_info_dma, aclpci->user_task) < 0) {
-              printk("Error sending signal to host!\n");
-           }
-     }
-     return 1;
-   }
-
    if (remaining > 0) {
       first = 0;
 
-      if (d->m_active_mem.dma.ptr == NULL || d->m_active_mem.pages_rem == 0) {
+      if (c->m_active_mem.dma.ptr == NULL || c->m_active_mem.pages_rem == 0) {
 
-        if (d->m_active_mem.pages_rem == 0) {
-          d->m_done_mem = d->m_active_mem;
-          d->m_active_mem.dma.ptr = NULL;
+        if (c->m_active_mem.pages_rem == 0) {
+          // A window still in done was only used by batches built before
+          // the one in flight, so they have all finished.
+          if (c->m_done_mem.dma.ptr != NULL) {
+            unlock_dma_buffer (aclpci, reading, &(c->m_done_mem.dma));
+          }
+          // Moved, not copied: nothing may be left to unlock twice
+          c->m_done_mem = c->m_active_mem;
+          memset (&c->m_active_mem, 0, sizeof(struct pinned_mem));
         }
 
-        if (d->m_pre_pinned_mem.dma.ptr == NULL) {
-          lock_size = (remaining > ((ACL_PCIE_DMA_PAGES_LOCKED * PAGE_SIZE) + ((ACL_PCIE_DMA_TABLE_SIZE - d->m_page_last_id) * PAGE_SIZE))) ?
-                  ((ACL_PCIE_DMA_PAGES_LOCKED * PAGE_SIZE) + ((ACL_PCIE_DMA_TABLE_SIZE-1 - d->m_page_last_id) * PAGE_SIZE)) : remaining;
+        if (c->m_pre_pinned_mem.dma.ptr == NULL) {
+          lock_size = window_bytes (aclpci, c, remaining);
 
-          if (lock_dma_buffer (aclpci, d->m_host_addr, lock_size, &d->m_active_mem) != 0) {
+          if (lock_dma_buffer (aclpci, reading, c->m_host_addr, lock_size, &c->m_active_mem) != 0) {
             ACL_DEBUG (KERN_WARNING "Failed lock dma buffer for %u bytes", (unsigned)lock_size);
             return -EFAULT;
           }
-          ACL_VERBOSE_DEBUG (KERN_DEBUG "Pinning %u bytes %i pages remaining", (unsigned int)lock_size, d->m_active_mem.pages_rem);
+          ACL_VERBOSE_DEBUG (KERN_DEBUG "Pinning %u bytes %i pages remaining", (unsigned int)lock_size, c->m_active_mem.pages_rem);
         } else {
-          d->m_active_mem = d->m_pre_pinned_mem;
-          d->m_pre_pinned_mem.dma.ptr = NULL;
+          c->m_active_mem = c->m_pre_pinned_mem;
+          memset (&c->m_pre_pinned_mem, 0, sizeof(struct pinned_mem));
         }
 
-        d->m_handle_last = (d->m_active_mem.last_page_offset != 0) ? 1 : 0;
-
-        // First page offset causes last page to have offset when max number of pages is pinned
-        if ((d->m_active_mem.pages_rem > (ACL_PCIE_DMA_PAGES_LOCKED)) && d->m_handle_last) {
-          d->m_active_mem.pages_rem--;
-          d->m_handle_last = 0;
-        }
-        next_page = *(d->m_active_mem.next_page);
-        d->m_cur_dma_addr = page_to_phys (next_page);
+        // Only the last window of a transfer can end inside a page
+        c->m_handle_last = (c->m_active_mem.last_page_offset != 0) ? 1 : 0;
+        c->m_cur_dma_addr = window_page_addr (&c->m_active_mem);
       }
 
-      single_page = (d->m_active_mem.pages_rem == 1) ? 1 : 0;
+      single_page = (c->m_active_mem.pages_rem == 1) ? 1 : 0;
 
       first_size = PAGE_SIZE;
-      first_size = (single_page) ? remaining : PAGE_SIZE - d->m_active_mem.first_page_offset;
+      first_size = (single_page) ? remaining : PAGE_SIZE - c->m_active_mem.first_page_offset;
       first_size = (first_size > PAGE_SIZE) ? PAGE_SIZE : first_size;
 
-      ACL_VERBOSE_DEBUG (KERN_DEBUG "single_page %i :: remaining %u :: first_size %u :: offset %u", single_page, (unsigned int)remaining, (unsigned int)first_size, d->m_active_mem.first_page_offset);
+      ACL_VERBOSE_DEBUG (KERN_DEBUG "single_page %i :: remaining %u :: first_size %u :: offset %u", single_page, (unsigned int)remaining, (unsigned int)first_size, c->m_active_mem.first_page_offset);
 
-      // Handler for non-aligned pages
+      // Handler for non-aligned pages. All pieces of the page go into one
+      // batch, and the full pages after it are added to the same batch.
+      n = 0;
       if ((first_size != PAGE_SIZE) && (first_size != 0)) {
-        ACL_VERBOSE_DEBUG (KERN_DEBUG "Handling first page with offset :: Transferring %u bytes :: page start %llx%llx :: offset %u", first_size, d->m_cur_dma_addr >> 32, d->m_cur_dma_addr & 0xffffffff, d->m_active_mem.first_page_offset);
-        result = non_aligned_page_handler(aclpci, (dma_addr_t) (d->m_cur_dma_addr + d->m_active_mem.first_page_offset), d->m_device_addr, first_size, reading);
-
+        ACL_VERBOSE_DEBUG (KERN_DEBUG "Handling first page with offset :: Transferring %u bytes :: page start %llx%llx :: offset %u", first_size, c->m_cur_dma_addr >> 32, c->m_cur_dma_addr & 0xffffffff, c->m_active_mem.first_page_offset);
+        result = get_start_id(aclpci, reading, &start_id, &first);
         if (result != 0) {
-          unlock_all_dma(aclpci);
+          printk(KERN_ERR "aclpci_dma: Failed get start id\n");
+          return -EFAULT;
+        }
+        n = non_aligned_page_handler(aclpci, (dma_addr_t) (c->m_cur_dma_addr + c->m_active_mem.first_page_offset), c->m_device_addr, first_size, reading, start_id, 0);
+        if (n < 0) {
           printk(KERN_ERR "aclpci_dma: Failed DMA First Page Transfer\n");
           return -EFAULT;
         }
-        return 1;
+
+        // Send the pieces on their own if the page isn't done yet or there
+        // are no full pages to follow
+        if (c->m_active_mem.first_page_offset != 0 || n == ACL_PCIE_DMA_RING_MAX_BATCH ||
+            c->m_active_mem.pages_rem <= c->m_handle_last) {
+          submit_batch(aclpci, reading, start_id, first, ring_index(start_id, n - 1), 0);
+          return 1;
+        }
+        remaining = c->m_bytes - c->m_bytes_sent;
       }
       // Handler for page size transactions
-      if (d->m_active_mem.pages_rem > d->m_handle_last) {
-        result = get_start_id(aclpci, reading, &start_id, &first);
-        if (result != 0) {
-          unlock_all_dma(aclpci);
-          printk(KERN_ERR "aclpci_dma: Failed get start id\n");
-          return -EFAULT;
+      if (c->m_active_mem.pages_rem > c->m_handle_last) {
+        if (n == 0) {
+          result = get_start_id(aclpci, reading, &start_id, &first);
+          if (result != 0) {
+            printk(KERN_ERR "aclpci_dma: Failed get start id\n");
+            return -EFAULT;
+          }
         }
-        max_transfer = (d->m_active_mem.pages_rem - d->m_handle_last > ACL_PCIE_DMA_TABLE_SIZE - start_id) ?
-                ACL_PCIE_DMA_TABLE_SIZE - start_id : d->m_active_mem.pages_rem - d->m_handle_last;
+        pages_left = c->m_active_mem.pages_rem - c->m_handle_last;
+        pages_sent = 0;
         wmb();
 
-        ACL_VERBOSE_DEBUG (KERN_DEBUG "Doing full table transfer :: pcie addr %llx%llx :: device addr %llx%llx", (u32) (d->m_cur_dma_addr >> 32), (u32) (d->m_cur_dma_addr & 0xffffffff), ((u64)(d->m_device_addr)) >> 32, ((u64)(d->m_device_addr)) & 0xffffffff);
-        for (i = start_id; i < start_id + max_transfer; i++) {
+        ACL_VERBOSE_DEBUG (KERN_DEBUG "Doing full table transfer :: pcie addr %llx%llx :: device addr %llx%llx", (u32) (c->m_cur_dma_addr >> 32), (u32) (c->m_cur_dma_addr & 0xffffffff), ((u64)(c->m_device_addr)) >> 32, ((u64)(c->m_device_addr)) & 0xffffffff);
+        // Each descriptor covers a run of physically contiguous pages (a huge
+        // page, a folio, or just neighbouring small pages), so one table can
+        // describe much more than ACL_PCIE_DMA_TABLE_SIZE pages. The batch
+        // carries on from start_id and wraps around the end of the ring.
+        for (max_transfer = n; max_transfer < ACL_PCIE_DMA_RING_MAX_BATCH && pages_sent < pages_left; max_transfer++) {
+          i = ring_index(start_id, max_transfer);
+          run = window_run (&c->m_active_mem, pages_left - pages_sent);
+          run_bytes = run * PAGE_SIZE;
           if (reading) {
-            set_write_desc(&d->desc_table_wr_cpu_virt_addr->descriptors[i], (u64)d->m_device_addr, (dma_addr_t) d->m_cur_dma_addr, PAGE_SIZE/4, i);
-            ++d->m_active_mem.next_page;
-            ++d->m_active_mem.next_dma_addr;
-            d->m_device_addr += PAGE_SIZE;
-            next_page = *(d->m_active_mem.next_page);
-            d->m_cur_dma_addr = page_to_phys (next_page);
+            set_write_desc(&c->desc_table->descriptors[i], (u64)c->m_device_addr, (dma_addr_t) c->m_cur_dma_addr, run_bytes/4, i);
           } else {
-            set_read_desc(&d->desc_table_rd_cpu_virt_addr->descriptors[i], (dma_addr_t) d->m_cur_dma_addr, (u64)d->m_device_addr, PAGE_SIZE/4, i);
-            ++d->m_active_mem.next_page;
-            ++d->m_active_mem.next_dma_addr;
-            d->m_device_addr += PAGE_SIZE;
-            next_page = *(d->m_active_mem.next_page);
-            d->m_cur_dma_addr = page_to_phys (next_page);
+            set_read_desc(&c->desc_table->descriptors[i], (dma_addr_t) c->m_cur_dma_addr, (u64)c->m_device_addr, run_bytes/4, i);
+          }
+          window_advance (&c->m_active_mem, run);
+          c->m_device_addr += run_bytes;
+          pages_sent += run;
+          // Don't look past the last extent
+          if (pages_sent < c->m_active_mem.pages_rem) {
+            c->m_cur_dma_addr = window_page_addr (&c->m_active_mem);
           }
         }
-        d->m_bytes_sent += PAGE_SIZE*max_transfer;
-        d->m_host_addr += PAGE_SIZE*max_transfer;
-        d->m_active_mem.pages_rem -= max_transfer;
-        remaining -= PAGE_SIZE*max_transfer;
-
-        last_id = max_transfer + start_id - 1;
-        d->m_page_last_id = last_id;
-        ACL_VERBOSE_DEBUG (KERN_DEBUG "Transfer pages start id = %i :: last id = %i :: max_transfer %i :: num pages %i", start_id, last_id, max_transfer, dma->num_pages);
-
-        d->m_us_valid = 1;
-        ktime_get_ts64(&(d->m_us_dma_start_time));
-        send_dma_desc(aclpci, reading, first, last_id);
-
-        // pre-pin/unpin memory. Coupled with above pinning of memory.
-        if (d->m_done_mem.dma.ptr != NULL) {
-          unlock_dma_buffer (aclpci, &(d->m_done_mem.dma));
-        }
-        if (remaining > 0 && d->m_active_mem.pages_rem == 0) {
-          lock_size = (remaining > ((ACL_PCIE_DMA_PAGES_LOCKED * PAGE_SIZE) + ((ACL_PCIE_DMA_TABLE_SIZE - d->m_page_last_id) * PAGE_SIZE))) ?
-                    ((ACL_PCIE_DMA_PAGES_LOCKED * PAGE_SIZE) + ((ACL_PCIE_DMA_TABLE_SIZE-1 - d->m_page_last_id) * PAGE_SIZE)) : remaining;
+        c->m_bytes_sent += PAGE_SIZE*pages_sent;
+        c->m_host_addr += PAGE_SIZE*pages_sent;
+        c->m_active_mem.pages_rem -= pages_sent;
+        remaining -= PAGE_SIZE*pages_sent;
+
+        last_id = ring_index(start_id, max_transfer - 1);
+        c->m_page_last_id = last_id;
+        ACL_VERBOSE_DEBUG (KERN_DEBUG "Transfer pages start id = %i :: last id = %i :: %u pages in %i descriptors :: num pages %i", start_id, last_id, pages_sent, max_transfer, dma->num_pages);
 
-          if (lock_dma_buffer (aclpci, d->m_host_addr, lock_size, &d->m_pre_pinned_mem) != 0) {
+        submit_batch(aclpci, reading, start_id, first, last_id, pages_sent);
+
+        // pre-pin memory. The done window is unpinned by aclpci_dma_update()
+        // once the batches using it are finished.
+        if (remaining > 0 && c->m_active_mem.pages_rem == 0) {
+          lock_size = window_bytes (aclpci, c, remaining);
+
+          if (lock_dma_buffer (aclpci, reading, c->m_host_addr, lock_size, &c->m_pre_pinned_mem) != 0) {
             // Don't EFAULT, since this will be re-tried on next interrupt.
             ACL_DEBUG (KERN_WARNING "Failed lock dma buffer for %u bytes", (unsigned)lock_size);
             return 1;
           }
 
-          ACL_VERBOSE_DEBUG (KERN_DEBUG "Pre-pinning %u bytes %i pages remaining", (unsigned int)lock_size, d->m_pre_pinned_mem.pages_rem);
+          ACL_VERBOSE_DEBUG (KERN_DEBUG "Pre-pinning %u bytes %i pages remaining", (unsigned int)lock_size, c->m_pre_pinned_mem.pages_rem);
         }
 
         return 1;
@@ -820,82 +2892,337 @@ int aclpci_dma_update (struct aclpci_dev *aclpci, int forced)
 }
 
 
+/* Retire the transfer at the front of the channel's queue with the given
+ * status, and start the next queued one, if any. Returns the started one,
+ * or NULL if the channel went idle.
+ * If aclpci_dma_stop() marked us idle, leave the rest of the queue alone.
+ * The other direction keeps its own queue and is not affected. */
+static struct dma_request *retire_request (struct aclpci_dev *aclpci, int reading, int status)
+{
+   struct aclpci_dma *d = &(aclpci->dma_data);
+   struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+   struct dma_request *req;
+   unsigned long flags;
+   int notify = 1;
+   void *uring_cmd = NULL;
+   u64 done_id = 0;
+
+   spin_lock_irqsave(&d->m_requests_lock, flags);
+   req = (struct dma_request *)queue_front(&c->m_requests);
+   if (req != NULL) {
+     notify = req->notify;
+     uring_cmd = req->uring_cmd;
+     done_id = req->id;
+     pool_put_request(d, req);
+     queue_pop(&c->m_requests);
+   }
+   req = (struct dma_request *)queue_front(&c->m_requests);
+   if (req != NULL && !c->m_idle) {
+     start_request(aclpci, req);
+   } else {
+     req = NULL;
+     c->m_idle = 1;
+   }
+   update_status_page(aclpci, done_id, status);
+   spin_unlock_irqrestore(&d->m_requests_lock, flags);
+
+   wake_up_all(&aclpci->wait_q);
+   if (uring_cmd != NULL) {
+     aclpci_uring_complete(uring_cmd, status);
+   }
+
+   // Interrupt to MMD layer for DMA done. Not needed when it is polling,
+   // or before the last segment of a vectored transfer. A registered
+   // eventfd replaces the signal.
+   if(!d->m_polling && notify && !aclpci_signal_eventfd(aclpci, ACLPCI_EVENT_DMA) &&
+      aclpci->user_task != NULL) {
+         if( send_sig_info(aclpci->signal_number, &aclpci->signal_info_dma, aclpci->user_task) < 0) {
+            printk("Error sending signal to host!\n");
+         }
+   }
+   return req;
+}
+
+/* The current transfer couldn't be pinned or mapped, and nothing of it is
+ * in flight any more. Drop it with -EFAULT, so its waiters get the error
+ * instead of hanging, and go on with the next one. */
+static int fail_request (struct aclpci_dev *aclpci, int reading, int forced)
+{
+   struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+
+   ACL_DEBUG (KERN_WARNING "DMA %s of %lu bytes at host addr %p failed",
+              reading ? "read" : "write", c->m_bytes, c->m_host_addr);
+   unlock_all_dma(aclpci, reading);
+   c->last_id = ACL_PCIE_DMA_RESET_ID;
+   c->m_page_last_id = ACL_PCIE_DMA_TABLE_SIZE-1;
+
+   if (retire_request(aclpci, reading, -EFAULT) != NULL) {
+     return aclpci_dma_update(aclpci, reading, forced);
+   }
+   return -EFAULT;
+}
+
+
+// Return 1 if something was done. 0 otherwise.
+int aclpci_dma_update (struct aclpci_dev *aclpci, int reading, int forced)
+{
+   struct aclpci_dma *d = &(aclpci->dma_data);
+   struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+   struct dma_t *dma = &(c->m_active_mem.dma);
+   struct dma_request *req;
+
+   size_t remaining;
+   int result;
+
+   u64 ej, latency, done_ns;
+
+   // When the batch in flight finished, as far as we know
+   done_ns = (c->m_irq_stamp != 0) ? c->m_irq_stamp : ktime_get_ns();
+   if (c->m_irq_stamp != 0) {
+     latency = ktime_get_ns() - c->m_irq_stamp;
+     c->m_irq_stamp = 0;
+     c->m_irq_count++;
+     c->m_irq_latency_total += latency;
+     if (latency > c->m_irq_latency_max) {
+       c->m_irq_latency_max = latency;
+     }
+   }
+
+   // Whatever the engine was working on is done. Start the batch that was
+   // built in the meantime before doing anything else, so the engine only
+   // waits for this last pointer write.
+   if (c->m_in_flight && c->m_flight_pages != 0) {
+     c->m_drain_ns = cost_average (c->m_drain_ns, div64_u64(done_ns - c->m_flight_stamp, c->m_flight_pages));
+   }
+   c->m_in_flight = 0;
+   if (c->m_staged_last_id != ACL_PCIE_DMA_RESET_ID) {
+     c->m_in_flight = 1;
+     c->m_flight_pages = c->m_staged_pages;
+     c->m_flight_stamp = ktime_get_ns();
+     send_dma_desc(aclpci, reading, c->m_staged_first, c->m_staged_last_id);
+     c->m_staged_last_id = ACL_PCIE_DMA_RESET_ID;
+   }
+
+   if (c->m_failed) {
+     c->m_failed = 0;
+     return fail_request(aclpci, reading, forced);
+   }
+
+   // The batches built from the done window have all finished by now
+   if (c->m_done_mem.dma.ptr != NULL) {
+     unlock_dma_buffer (aclpci, reading, &(c->m_done_mem.dma));
+   }
+
+   remaining = c->m_bytes - c->m_bytes_sent;
+
+   // DMA transaction complete. Reset values and return.
+   if (remaining == 0 && !c->m_in_flight) {
+     c->last_id = ACL_PCIE_DMA_RESET_ID;
+     c->m_page_last_id = ACL_PCIE_DMA_TABLE_SIZE-1;
+
+     unlock_dma_buffer (aclpci, reading, dma);
+     if (c->m_done_mem.dma.ptr != NULL) {
+        unlock_dma_buffer (aclpci, reading, &(c->m_done_mem.dma));
+      }
+
+     ACL_VERBOSE_DEBUG (KERN_DEBUG "Done DMA for device_addr: %llx host_addr: %llx reading: %i bytes: %u\n", (u64)c->m_device_addr, (u64)c->m_host_addr, reading, (unsigned int) c->m_bytes);
+
+     ej = get_jiffies_64();
+     ACL_VERBOSE_DEBUG (KERN_DEBUG "Spent %u msec %sing %u bytes", jiffies_to_msecs(ej - c->m_start_time),
+                           reading ? "read" : "writ", (unsigned int) c->m_bytes);
+
+     req = retire_request(aclpci, reading, 0);
+
+     // Start the next transfer right away instead of waiting for the user
+     if (req != NULL) {
+       return aclpci_dma_update(aclpci, reading, forced);
+     }
+     return 1;
+   }
+
+   // Keep the engine busy with one batch while building the next one
+   while (remaining > 0 && c->m_staged_last_id == ACL_PCIE_DMA_RESET_ID) {
+     result = build_batch(aclpci, reading);
+     if (result < 0) {
+       if (c->m_in_flight) {
+         // Can't unpin yet, the engine is still using the pages
+         c->m_failed = 1;
+         return 1;
+       }
+       return fail_request(aclpci, reading, forced);
+     }
+     if (result == 0) {
+       break;
+     }
+     remaining = c->m_bytes - c->m_bytes_sent;
+   }
+
+   return 1;
+}
+
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
 void wq_func_dma_update(void *data){
-   struct aclpci_dev *aclpci = (struct aclpci_dev *)data;
+   struct aclpci_dma_chan *c = (struct aclpci_dma_chan *)data;
 #else
 void wq_func_dma_update(struct work_struct *pwork){
    struct work_struct_t * my_work_struct_t = container_of(pwork, struct work_struct_t, work);
-   struct aclpci_dev *aclpci = (struct aclpci_dev *)my_work_struct_t->data;
+   struct aclpci_dma_chan *c = (struct aclpci_dma_chan *)my_work_struct_t->data;
 #endif
 
-   aclpci_dma_update(aclpci, 1);
+   mutex_lock(&c->m_update_lock);
+   aclpci_dma_update(c->m_aclpci, c->m_read, 1);
+   mutex_unlock(&c->m_update_lock);
 
    return;
 }
 
 
-int read_write
-(
-   struct aclpci_dev *aclpci,
-   void* src,
-   void *dst,
-   size_t bytes,
-   int reading
-)
+/* Load req into the transfer state of its channel. req must be at the front
+ * of that channel's request queue. Called with m_requests_lock held. */
+static void start_request (struct aclpci_dev *aclpci, struct dma_request *req)
 {
-   size_t dev_addr;
    void *dma_desc_base;
-   struct aclpci_dma *d = &(aclpci->dma_data);
-
-    // TODO: For now, only handle one transfer at a time
-   assert(d->m_active_mem.dma.ptr == NULL);
+   struct aclpci_dma_chan *c = get_chan(aclpci, req->reading);
 
    // Copy the parameters over and mark the job as running
-   d->m_read = reading;
-   d->m_bytes = (bytes);
-   assert(d->m_bytes == bytes);
-   d->m_host_addr = reading ? dst : src;
-   dev_addr = (size_t)(reading ? src : dst);
-   d->m_device_addr = (size_t)(dev_addr);
-   d->m_idle = 0;
-   d->m_page_last_id = 127;
+   c->m_bytes = req->bytes;
+   c->m_host_addr = req->host_addr;
+   c->m_host_buf = req->host_buf;
+   c->m_device_addr = (size_t)(req->device_addr);
+   c->m_idle = 0;
+   c->m_page_last_id = 127;
 
    //Keep local copy of last_id for current transfer. We don't have to read from pcie every table.
    dma_desc_base = get_dma_desc_offset(aclpci);
-   if (reading) {
-     d->dma_wr_last_id = ioread32(dma_desc_base+ACL_PCIE_DMA_WR_LAST_PTR);
+   if (req->reading) {
+     c->last_id = ioread32(dma_desc_base+ACL_PCIE_DMA_WR_LAST_PTR);
    } else {
-     d->dma_rd_last_id = ioread32(dma_desc_base+ACL_PCIE_DMA_RD_LAST_PTR);
+     c->last_id = ioread32(dma_desc_base+ACL_PCIE_DMA_RD_LAST_PTR);
    }
 
    // Start processing the request
-   d->m_bytes_sent = 0;
+   c->m_bytes_sent = 0;
+
+   c->m_update_time = 0;
+   c->m_pin_time = c->m_lock_time = c->m_unlock_time = 0;
+   c->m_start_time = get_jiffies_64();
+
+   ACL_VERBOSE_DEBUG (KERN_DEBUG "Starting DMA %llu for device addr: %p host addr: %p reading: %i bytes: %lu\n",
+                      req->id, req->device_addr, req->host_addr, req->reading, req->bytes);
+}
+
 
-   d->m_update_time = 0;
-   d->m_pin_time = d->m_lock_time = d->m_unlock_time = 0;
-   d->m_start_time = get_jiffies_64();
+/* Queue transfers in one direction, all or none of them. If the channel is
+ * idle, the first one is started right away. Otherwise they start as soon
+ * as all transfers previously queued in the same direction are done. The
+ * id of the last one is written to id, if not NULL. */
+static int queue_requests (struct aclpci_dev *aclpci, struct dma_request *reqs, unsigned int n, int reading, u64 *id)
+{
+   struct aclpci_dma *d = &(aclpci->dma_data);
+   struct aclpci_dma_chan *c = get_chan(aclpci, reading);
+   unsigned long flags;
+   unsigned int i;
+   int start;
+
+   spin_lock_irqsave(&d->m_requests_lock, flags);
+   if (c->m_requests.size - queue_size(&c->m_requests) < n) {
+     spin_unlock_irqrestore(&d->m_requests_lock, flags);
+     ACL_DEBUG (KERN_WARNING "DMA request queue is full");
+     return -EBUSY;
+   }
+   for (i = 0; i < n; i++) {
+     reqs[i].id = ++d->m_last_submitted_id;
+     queue_push(&c->m_requests, &reqs[i]);
+     ACL_VERBOSE_DEBUG (KERN_DEBUG "Queued DMA %llu for device addr: %p host addr: %p reading: %i bytes: %lu\n", reqs[i].id, reqs[i].device_addr, reqs[i].host_addr, reading, reqs[i].bytes);
+   }
+   if (id != NULL) {
+     *id = d->m_last_submitted_id;
+   }
 
-   ACL_VERBOSE_DEBUG (KERN_DEBUG "Entered DMA for src: %llx dst: %llx reading: %i bytes: %u\n", src, dst, reading, bytes);
+   start = c->m_idle;
+   if (start) {
+     start_request(aclpci, (struct dma_request *)queue_front(&c->m_requests));
+   }
+   update_status_page(aclpci, 0, 0);
+   spin_unlock_irqrestore(&d->m_requests_lock, flags);
 
-   if( !queue_work(d->my_wq, &d->my_work->work) ){
-      printk("fail to schedule the work\n");
+   // In polling mode, the next aclpci_dma_poll() starts it
+   if (start && !d->m_polling) {
+     if( !queue_work(d->my_wq, &c->my_work->work) ){
+        printk("fail to schedule the work\n");
+     }
    }
 
-   return 1;
+   return 0;
+}
+
+
+/* Queue a transfer. See queue_requests(). The user is signalled when it is
+ * done if notify is set. Transfers the driver waits for itself don't.
+ * host_buf is the bounce or pool buffer the host side is in, or NULL for
+ * user memory. */
+int read_write
+(
+   struct aclpci_dev *aclpci,
+   void* src,
+   void *dst,
+   size_t bytes,
+   int reading,
+   struct dma_region *host_buf,
+   int notify,
+   u64 *id
+)
+{
+   struct dma_request req;
+
+   req.reading = reading;
+   req.bytes = bytes;
+   req.host_addr = reading ? dst : src;
+   req.device_addr = reading ? src : dst;
+   req.notify = notify;
+   req.uring_cmd = NULL;
+   req.host_buf = host_buf;
+
+   return queue_requests(aclpci, &req, 1, reading, id);
 }
 
 
 #else // USE_DMA is 0
 
-irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci) {
+irqreturn_t aclpci_dma_service_interrupt (struct aclpci_dev *aclpci, unsigned int dma_update) {
+  return IRQ_HANDLED;
+}
+irqreturn_t aclpci_dma_irq_thread (struct aclpci_dev *aclpci) {
   return IRQ_HANDLED;
 }
 ssize_t aclpci_dma_rw (struct aclpci_dev *aclpci,
                        void *dev_addr, void __user* user_addr,
-                       ssize_t len, int reading) {return 0; }
+                       ssize_t len, int reading, u64 *sync_id) {return 0; }
+int aclpci_dma_wait_sync (struct aclpci_dev *aclpci, int reading, u64 id) { return 0; }
+ssize_t aclpci_dma_rw_sync (struct aclpci_dev *aclpci,
+                            void *dev_addr, void __user* user_addr,
+                            ssize_t len, int reading) {return -ENOMEM; }
+ssize_t aclpci_dma_rw_vector (struct aclpci_dev *aclpci,
+                              struct acl_dma_segment __user *segs,
+                              size_t count, int reading, u64 *sync_id) {return -EINVAL; }
+int aclpci_dma_rw_uring (struct aclpci_dev *aclpci, void *dev_addr, void __user* user_addr,
+                         ssize_t len, int reading, void *uring_cmd) {return -EINVAL; }
+void aclpci_dma_open(struct aclpci_dev *aclpci) {}
+void aclpci_dma_close(struct aclpci_dev *aclpci) {}
 void aclpci_dma_init(struct aclpci_dev *aclpci) {}
 void aclpci_dma_finish(struct aclpci_dev *aclpci) {}
 int aclpci_dma_get_idle_status(struct aclpci_dev *aclpci) { return 1; }
+int aclpci_dma_set_polling(struct aclpci_dev *aclpci, int polling) { return -EINVAL; }
+void aclpci_dma_set_sync(struct aclpci_dev *aclpci, unsigned int timeout_ms) {}
+int aclpci_dma_poll(struct aclpci_dev *aclpci) { return 0; }
+int aclpci_dma_wait_idle(struct aclpci_dev *aclpci) { return 0; }
+u64 aclpci_dma_get_submitted_id(struct aclpci_dev *aclpci) { return 0; }
+u64 aclpci_dma_get_completed_id(struct aclpci_dev *aclpci) { return 0; }
+int aclpci_dma_register_region(struct aclpci_dev *aclpci, void __user *addr, size_t len, u32 *handle) { return -EINVAL; }
+int aclpci_dma_unregister_region(struct aclpci_dev *aclpci, u32 handle) { return -EINVAL; }
+int aclpci_dma_alloc_buffer(struct aclpci_dev *aclpci, size_t len, u32 *handle) { return -EINVAL; }
+int aclpci_dma_free_buffer(struct aclpci_dev *aclpci, u32 handle) { return -EINVAL; }
+int aclpci_dma_mmap(struct aclpci_dev *aclpci, struct vm_area_struct *vma) { return -EINVAL; }
 
 #endif // USE_DMA
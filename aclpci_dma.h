@@ -49,27 +49,171 @@
 /* Enable Linux-specific defines in the hw_pcie_dma.h file */
 #define LINUX
 #include <linux/workqueue.h>
+#include <linux/version.h>
+#include <linux/scatterlist.h>
 #include "hw_pcie_dma.h"
 #include "aclpci_queue.h"
 
+/* The pinned-page cache must hear about munmap()/mremap() of cached ranges,
+ * which needs mmu_interval_notifier. Without it, windows are unpinned after
+ * every use as before. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+#  define ACL_DMA_PIN_CACHE 1
+#  include <linux/interval_tree.h>
+#  include <linux/mmu_notifier.h>
+#else
+#  define ACL_DMA_PIN_CACHE 0
+#endif
+
+/* Run of physically contiguous pages. The small pages of a transparent
+ * huge page or a hugetlbfs page are contiguous, so each huge page (or a
+ * longer run of them) takes a single entry instead of one per 4K page. */
+struct dma_extent {
+  struct page *page;       /* first page of the run */
+  dma_addr_t dma_addr;     /* bus address of the first page */
+  unsigned int num_pages;
+};
+/* Extents are mapped together as one sg_table. Behind an IOMMU, neighbouring
+ * extents usually get consecutive bus addresses, and descriptors run across
+ * them. */
+
 struct dma_t {
   void *ptr;         /* if ptr is NULL, the whole struct considered invalid */
   size_t len;
   enum dma_data_direction dir;
-  struct page **pages;     /* one for each struct page */
-  dma_addr_t *dma_addrs;   /* one for each struct page */
+  struct dma_extent *extents;
+  unsigned int num_extents;
+  unsigned int first_page;   /* index in extents[0] of the page holding ptr */
+  unsigned int num_pages;
+  struct dma_region *region; /* if not NULL, extents are borrowed from this region */
+  struct sg_table sgt;       /* mapping of the extents, unless borrowed */
+};
+
+/* Maximum number of user buffers that can be registered, plus buffers
+ * allocated by the driver, at once */
+#define ACL_PCIE_DMA_MAX_REGIONS 16
+
+/* Largest chunk tried when allocating a driver-owned DMA buffer.
+ * 2MB with 4K pages, the size of a huge page on x86. */
+#define ACL_PCIE_DMA_BUF_MAX_ORDER 9
+
+/* Largest driver-owned DMA buffer. Its pages also count against
+ * RLIMIT_MEMLOCK. */
+#define ACL_PCIE_DMA_BUF_MAX_SIZE (256UL << 20)
+
+/* Size of the bounce buffer used for transfers whose host and device
+ * addresses can't both be 64-byte aligned. It is used as two halves, so
+ * one half can be copied while the other is being DMA'd. */
+#define ACL_PCIE_DMA_BOUNCE_SIZE (128 * 1024)
+
+/* How long to wait for a transfer through the bounce buffer, in msec */
+#define ACL_PCIE_DMA_BOUNCE_TIMEOUT_MS 10000
+
+/* Pool of small bounce buffers. Aligned transfers that fit in one are
+ * copied through it, which is much cheaper than pinning the user's pages
+ * for small sizes. */
+#define ACL_PCIE_DMA_POOL_BUFS 8
+#define ACL_PCIE_DMA_POOL_BUF_SIZE (64 * 1024)
+
+/* Pages of a buffer allocated with ACLPCI_CMD_ALLOC_DMA_BUFFER. Its
+ * m_regions slot and every VMA mapping it hold a reference, and the pages
+ * are freed with the last one, so they outlive the slot while mapped. */
+struct dma_buffer {
+  atomic_t refs;
+  atomic_t mmap_count;            /* number of VMAs */
+  struct device *dev;
+  struct mm_struct *mm;           /* charged in pinned_vm, or NULL */
   unsigned int num_pages;
+  unsigned int num_extents;
+  struct dma_extent *extents;     /* one per chunk from alloc_pages() */
+};
+
+/* User buffer registered with ACLPCI_CMD_PIN_USER_ADDR, buffer allocated
+ * with ACLPCI_CMD_ALLOC_DMA_BUFFER, or an entry of the pinned-page cache.
+ * It is pinned and mapped once, and transfers that fall inside it use its
+ * pages directly. */
+struct dma_region {
+  void *ptr;         /* user address. NULL for driver buffers, which are
+                      * found through their VMA instead */
+  size_t len;
+  enum dma_data_direction dir;
+  struct dma_extent *extents;  /* if NULL, the slot is free */
+  unsigned int num_extents;
+  unsigned int num_pages;
+  /* Mapping of pinned user pages. Driver buffers map each extent with
+   * dma_map_page() instead and leave this empty. */
+  struct sg_table sgt;
+  /* Only set for buffers allocated by the driver. extents are the
+   * buffer's. */
+  struct dma_buffer *buf;
+  /* Number of pinned windows currently using the pages. The region
+   * can't be unregistered while this is not 0. */
+  int refcount;
+  /* 1 for pinned-page cache entries, which are protected by m_cache_lock
+   * instead of m_regions_lock. */
+  int cached;
+#if ACL_DMA_PIN_CACHE
+  /* The fields below are only used by cache entries */
+  struct aclpci_dev *aclpci;
+  struct mm_struct *mm;
+  struct interval_tree_node it;   /* page-aligned [start, last] */
+  struct mmu_interval_notifier notifier;
+  struct list_head lru;
+  /* Set when the range was unmapped or remapped. A stale entry is never
+   * handed out again. It is freed by m_unpin_work if it was unused, or
+   * once its refcount drops to 0 otherwise. */
+  int stale;
+  /* Set once the entry is in the tree and the LRU list. Before that the
+   * window pinning it owns it, and the notifier only marks it stale. */
+  int inserted;
+#endif
+};
+
+/* Pages of a finished window, waiting to be unpinned by m_unpin_work */
+struct deferred_unpin {
+  struct list_head list;
+  struct dma_extent *extents;
+  unsigned int num_extents;
+  int dirty;
+};
+
+/* Extent array for one pinned window, recycled through the window pool so
+ * that pinning a window allocates nothing in steady state. unpin queues it
+ * for unpinning without allocating a node either. */
+#define ACL_PCIE_DMA_WIN_POOL 8
+struct dma_win_buf {
+  struct deferred_unpin unpin;
+  struct scatterlist *sgl;       /* ACL_PCIE_DMA_PIN_BATCH entries, after extents */
+  struct dma_extent extents[];   /* ACL_PCIE_DMA_PIN_BATCH entries */
 };
 
 struct pinned_mem {
   struct dma_t dma;
-  struct page **next_page;
-  dma_addr_t *next_dma_addr;
+  struct dma_extent *next_extent;  /* extent holding the next page to transfer */
+  unsigned int next_extent_page;   /* index of that page within next_extent */
   unsigned int pages_rem;
   unsigned int first_page_offset;
   unsigned int last_page_offset;
 };
 
+/* Maximum number of DMA transfers that can be queued at once, per
+ * direction. Also the most segments a vectored transfer can have. */
+#define ACL_PCIE_DMA_MAX_REQUESTS 256
+
+/* A DMA transfer submitted through read()/write() on ACLPCI_DMA_BAR */
+struct dma_request {
+  u64 id;
+  void *device_addr;
+  void *host_addr;
+  size_t bytes;
+  int reading;
+  int notify;   /* signal the user when done. Only the last segment of a vector does */
+  void *uring_cmd;  /* io_uring command to complete when done, or NULL */
+  /* Bounce or pool buffer host_addr is a kernel address in, or NULL if it
+   * is user memory. Never inferred from the address. */
+  struct dma_region *host_buf;
+};
+
 struct work_struct_t{
    struct work_struct work;
    void *data;
@@ -94,20 +238,46 @@ struct dma_desc_table {
     struct dma_desc_entry descriptors[ACL_PCIE_DMA_DESC_MAX_ENTRIES];
 } __attribute__ ((packed));
 
-struct aclpci_dma {
+/* The engine has independent host-to-device and device-to-host halves,
+ * each with its own descriptor table and registers. Each half is driven by
+ * its own channel, indexed by the 'reading' flag used throughout the driver.
+ * Host-to-device transfers use the engine's read (RD) descriptor table,
+ * device-to-host transfers use the write (WR) one. */
+#define ACL_DMA_CHAN_TO_DEVICE    0
+#define ACL_DMA_CHAN_FROM_DEVICE  1
+#define ACL_DMA_NUM_CHANS         2
 
-  // Pci-E DMA IP description table
-  struct dma_desc_table *desc_table_rd_cpu_virt_addr;
-  struct dma_desc_table *desc_table_wr_cpu_virt_addr;
+struct aclpci_dma_chan {
 
-  dma_addr_t desc_table_rd_bus_addr;
-  dma_addr_t desc_table_wr_bus_addr;
+  // 1 if this channel moves data from the device to the host
+  int m_read;
+  struct aclpci_dev *m_aclpci;
+
+  // Descriptor table used by this channel. Points at one of the tables
+  // allocated in probe().
+  struct dma_desc_table *desc_table;
+  dma_addr_t desc_table_bus_addr;
 
   // Local copy of last transfer id. Read once when DMA transfer starts
-  int dma_rd_last_id;
-  int dma_wr_last_id;
+  int last_id;
   int m_page_last_id;
 
+  // Descriptor base, FIFO base and table size have been written for this
+  // session. After that only the last pointer is advanced, and the table
+  // is used as a ring.
+  int m_ring_ready;
+
+  // A batch of descriptors was given to the engine and is not done yet
+  int m_in_flight;
+  // Next batch, built while the one in flight executes. Its descriptors
+  // follow last_id in the ring, and only the last pointer has to be
+  // written to start it. ACL_PCIE_DMA_RESET_ID if there is none.
+  int m_staged_last_id;
+  int m_staged_first;
+  // Building the next batch failed while pages were still in use by the
+  // one in flight. The transfer is dropped once that one is done.
+  int m_failed;
+
   // Pinned memory we're currently building DMA transactions for
   struct pinned_mem m_active_mem;
   struct pinned_mem m_pre_pinned_mem;
@@ -117,27 +287,128 @@ struct aclpci_dma {
   unsigned long m_cur_dma_addr;
   int m_handle_last;
 
-  struct pci_dev *m_pci_dev;
-  struct aclpci_dev *m_aclpci;
+  // Submitted transfers for this direction, in order. The one at the front
+  // is in progress. Protected by aclpci_dma.m_requests_lock.
+  struct queue m_requests;
 
-  // workqueue and work structure for bottom-half interrupt routine
-  struct workqueue_struct *my_wq;
+  // work structure for bottom-half interrupt routine
   struct work_struct_t *my_work;
-  
+
+  // Scratch page array for pinning this channel's windows, or NULL
+  struct page **m_pin_pages;
+
+  // Pin-ahead window size in pages, and running averages of what a page
+  // costs to pin and for the engine to move, in ns (0 until measured)
+  unsigned int m_win_pages;
+  u64 m_pin_ns, m_drain_ns;
+
+  // Pages in the batch the engine is working on and when it was sent, and
+  // pages in the staged batch. Batches too small to measure count as 0.
+  unsigned int m_flight_pages, m_staged_pages;
+  u64 m_flight_stamp;
+
   // Transfer information
   size_t m_device_addr;
   void* m_host_addr;
-  int m_read;
+  struct dma_region *m_host_buf;   /* host_buf of the request */
   size_t m_bytes;
   size_t m_bytes_sent;
   int m_idle;
 
   u64 m_update_time, m_pin_time, m_start_time;
   u64 m_lock_time, m_unlock_time;
-  
+
   // Time measured to us accuracy to measure DMA transfer time
   struct timespec64 m_us_dma_start_time;
   int m_us_valid;
+
+  // Serializes aclpci_dma_update() between the IRQ thread and the workqueue
+  struct mutex m_update_lock;
+
+  // Time from the interrupt to aclpci_dma_update() starting on it, in ns.
+  // m_irq_stamp is set by the interrupt handler and 0 when not waiting.
+  u64 m_irq_stamp;
+  u64 m_irq_count, m_irq_latency_total, m_irq_latency_max;
+};
+
+struct aclpci_dma {
+
+  // Pci-E DMA IP description table
+  struct dma_desc_table *desc_table_rd_cpu_virt_addr;
+  struct dma_desc_table *desc_table_wr_cpu_virt_addr;
+
+  dma_addr_t desc_table_rd_bus_addr;
+  dma_addr_t desc_table_wr_bus_addr;
+
+  // Per-direction transfer state, indexed by 'reading'
+  struct aclpci_dma_chan m_chan[ACL_DMA_NUM_CHANS];
+
+  // Protects the request queues of both channels and the ids below
+  spinlock_t m_requests_lock;
+  u64 m_last_submitted_id;
+
+  // Windows that are done, unpinned in the background so that unpinning
+  // doesn't hold up the next batch or the done notification
+  struct list_head m_unpin_list;
+  spinlock_t m_unpin_lock;
+  struct work_struct m_unpin_work;
+
+  // Registered user buffers. Handle of a region is its index + 1.
+  struct dma_region m_regions[ACL_PCIE_DMA_MAX_REGIONS];
+  struct mutex m_regions_lock;
+
+#if ACL_DMA_PIN_CACHE
+  // Recently pinned windows, looked up by user address. The LRU list has
+  // the most recently used entry first. m_cache_pages is the number of
+  // pages pinned by all entries.
+  struct rb_root_cached m_cache_tree;
+  struct list_head m_cache_lru;
+  unsigned long m_cache_pages;
+  spinlock_t m_cache_lock;
+  // Unused entries whose range was unmapped, taken out of the tree and the
+  // LRU list by the notifier and waiting to be unpinned by m_unpin_work.
+  struct list_head m_cache_dead;
+#endif
+
+  struct pci_dev *m_pci_dev;
+  struct aclpci_dev *m_aclpci;
+
+  // workqueue for bottom-half interrupt routine, shared by both channels
+  struct workqueue_struct *my_wq;
+
+  // Bit 'reading' is set for each channel the IRQ thread has to update
+  unsigned long m_irq_pending;
+
+  // DMA is moved along by the user through aclpci_dma_poll() instead of by
+  // interrupts, for the whole device. Only changed while both channels are
+  // idle.
+  int m_polling;
+
+  // If not 0, DMA read()/write() waits for the transfer to be done, at most
+  // this many ms. See ACLPCI_CMD_SET_DMA_SYNC.
+  unsigned int m_sync_ms;
+
+  // Bounce buffers, allocated and mapped once per open. ptr is the
+  // kernel address, so transfers from/to them find them like a registered
+  // region. extents is NULL if a buffer couldn't be allocated.
+  struct dma_region m_bounce;
+  struct dma_extent m_bounce_extent;
+  struct dma_region m_pool[ACL_PCIE_DMA_POOL_BUFS];
+  struct dma_extent m_pool_extent[ACL_PCIE_DMA_POOL_BUFS];
+
+  // One bit per pool buffer that is in use
+  unsigned long m_pool_busy;
+
+  // Transfers still using the bounce buffer or a pool buffer after their
+  // waiter timed out or was interrupted, or 0. The buffer is busy until
+  // that transfer is done.
+  u64 m_bounce_pending;
+  u64 m_pool_pending[ACL_PCIE_DMA_POOL_BUFS];
+
+  // Window pool, allocated once per open. Entries are NULL if they
+  // couldn't be allocated. One bit per entry in use in m_win_busy.
+  struct dma_win_buf *m_win_pool[ACL_PCIE_DMA_WIN_POOL];
+  unsigned long m_win_busy;
 };
 
 #else
@@ -48,6 +48,7 @@
 
 #include <linux/jiffies.h>
 #include <linux/sched.h>
+#include <linux/mman.h>
 #include <asm/io.h> // __raw_write, __raw_read
 #include "aclpci.h"
 
@@ -56,6 +57,7 @@ static ssize_t aclpci_rw_large (void *dev_addr, void __user* use_addr, ssize_t l
 
 
 
+
 /* Given (bar_id, device_addr) pair, make sure they're valid and return
  * the resulting address. errno will contain error code, if any. */
 void* aclpci_get_checked_addr (int bar_id, void *device_addr, size_t count,
@@ -178,7 +180,10 @@ int aclpci_open(struct inode *inode, struct file *file) {
 
   aclpci->global_mem_segment = 0;
   aclpci->saved_kernel_irq_mask = 0;
+  aclpci->kernel_irq_pending = 0;
+  memset (aclpci->status_page, 0, PAGE_SIZE);
   aclpci->global_mem_segment_addr = get_segment_ctrl_addr(aclpci);
+  aclpci_dma_open (aclpci);
 #if 0
   if (aclpci->user_pid == -1) {
     aclpci->user_pid = current->tgid;
@@ -242,6 +247,9 @@ int aclpci_close(struct inode *inode, struct file *file) {
   if (aclpci->num_handles_open == 0) {
     /* only when all handles are closed, do we perform the device finalization */
     release_irq (aclpci->pci_dev, aclpci);
+    aclpci_dma_close (aclpci);
+    aclpci_set_eventfd (aclpci, ACLPCI_EVENT_KERNEL, -1);
+    aclpci_set_eventfd (aclpci, ACLPCI_EVENT_DMA, -1);
   }
 
   atomic_set(&aclpci->status, 0);
@@ -477,19 +485,256 @@ int aligned_request (struct acl_cmd *cmd, size_t count) {
 }
 
 
+/* Read/write a piece of global memory through the memory window. The
+ * segment is restored afterwards. */
+static ssize_t aclpci_rw_window (struct aclpci_dev *aclpci, void *device_addr,
+                                 void __user* user_addr, size_t len,
+                                 int reading, int access_le) {
+
+  u64 old_segment = aclpci->global_mem_segment;
+  ssize_t errno = 0;
+  ssize_t result;
+  void *addr;
+
+  device_addr = aclpci_set_segment (aclpci, device_addr);
+  addr = aclpci_get_checked_addr (ACL_PCIE_MEMWINDOW_BAR, device_addr, len, aclpci, &errno, 1);
+  if (errno != 0 || !address_range_check(ACL_PCIE_MEMWINDOW_BAR, device_addr, len, aclpci)) {
+    ACL_DEBUG (KERN_DEBUG "Blocked illegal device address access");
+    result = -EFAULT;
+  } else {
+    result = aclpci_rw_large (addr, user_addr, len, aclpci->buffer, reading, access_le);
+  }
+
+  aclpci_set_segment_by_val (aclpci, old_segment);
+  return result;
+}
+
+
+/* Large global memory access that doesn't meet the DMA alignment rules.
+ * The device side is split into an unaligned head and tail, which go
+ * through the memory window (so no read-modify-write of device memory is
+ * needed), and a 64-byte aligned body, which is DMA'd. If the host side of
+ * the body isn't aligned, the DMA goes through the bounce buffer.
+ * Returns once all of the data has been transferred, like the memory
+ * window access it replaces. */
+static ssize_t aclpci_rw_unaligned (struct aclpci_dev *aclpci, struct acl_cmd *cmd,
+                                    size_t size, int reading, int access_le) {
+
+  size_t head = (-(unsigned long)cmd->device_addr) & DMA_ALIGNMENT_BYTE_MASK;
+  size_t tail = ((unsigned long)cmd->device_addr + size) & DMA_ALIGNMENT_BYTE_MASK;
+  size_t body = size - head - tail;
+  char __user *user = (char __user*) cmd->user_addr;
+  char *dev = (char*) cmd->device_addr;
+  ssize_t result;
+
+  ACL_VERBOSE_DEBUG (KERN_DEBUG "Unaligned access: head %lu, body %lu, tail %lu bytes", head, body, tail);
+
+  if (head > 0) {
+    result = aclpci_rw_window (aclpci, dev, user, head, reading, access_le);
+    if (result < 0) {
+      return result;
+    }
+  }
+  if (tail > 0) {
+    result = aclpci_rw_window (aclpci, dev + head + body, user + head + body, tail, reading, access_le);
+    if (result < 0) {
+      return result;
+    }
+  }
+
+  result = aclpci_dma_rw_sync (aclpci, dev + head, user + head, body, reading);
+  if (result == -ENOMEM) {
+    // No bounce buffer, do it the slow way
+    result = aclpci_rw_window (aclpci, dev + head, user + head, body, reading, access_le);
+  }
+  return result;
+}
+
+
+/* Set the transfer thresholds to the values used before calibration */
+void aclpci_init_thresholds (struct aclpci_dev *aclpci) {
+
+  int reading;
+
+  for (reading = 0; reading < 2; reading++) {
+    aclpci->dma_min[reading] = ACL_DMA_MIN_DEFAULT;
+#if USE_DMA
+    aclpci->dma_pin_min[reading] = ACL_PCIE_DMA_POOL_BUF_SIZE + 1;
+#else
+    aclpci->dma_pin_min[reading] = 0;
+#endif
+  }
+}
+
+
+#if USE_DMA
+
+/* Runs per calibration measurement */
+#define ACL_CALIB_REPS 4
+
+/* Time one calibration transfer. Returns 0 if it failed. */
+static u64 calib_time (struct aclpci_dev *aclpci, int method, void *dev_addr,
+                       void __user *user_addr, size_t len, int reading) {
+
+  u64 start = ktime_get_ns();
+  ssize_t result;
+
+  if (method == ACL_CALIB_PIO) {
+    result = aclpci_rw_window (aclpci, dev_addr, user_addr, len, reading, 1);
+  } else {
+    // Steer aclpci_dma_rw() to the method being timed
+    aclpci->dma_pin_min[reading] = (method == ACL_CALIB_PINNED) ? 0 : ~(size_t)0;
+    result = aclpci_dma_rw (aclpci, dev_addr, user_addr, len, reading, NULL);
+    if (result >= 0) {
+      result = aclpci_dma_wait_idle (aclpci);
+    }
+  }
+  if (result < 0) {
+    return 0;
+  }
+  return max_t(u64, ktime_get_ns() - start, 1);
+}
+
+
+/* Pick the thresholds for one direction from the calibration results. Each
+ * threshold is the smallest size from which on the faster method keeps
+ * winning. Sizes a method wasn't timed at count as a loss for it. */
+static void calib_pick (struct aclpci_dev *aclpci, int reading) {
+
+  u64 *pio = aclpci->calib_ns[ACL_CALIB_PIO][reading];
+  u64 *bounce = aclpci->calib_ns[ACL_CALIB_BOUNCE][reading];
+  u64 *pinned = aclpci->calib_ns[ACL_CALIB_PINNED][reading];
+  size_t size;
+  u64 dma;
+  int i;
+
+  aclpci->dma_min[reading] = ACL_DMA_MIN_DEFAULT;
+  aclpci->dma_pin_min[reading] = ACL_PCIE_DMA_POOL_BUF_SIZE + 1;
+  for (i = ACL_CALIB_SIZES - 1; i >= 0; i--) {
+    if (bounce[i] != 0 && bounce[i] < pinned[i]) {
+      break;
+    }
+    aclpci->dma_pin_min[reading] = (size_t)ACL_CALIB_MIN_SIZE << i;
+  }
+  for (i = ACL_CALIB_SIZES - 1; i >= 0; i--) {
+    size = (size_t)ACL_CALIB_MIN_SIZE << i;
+    dma = (size < aclpci->dma_pin_min[reading]) ? bounce[i] : pinned[i];
+    if (pio[i] != 0 && pio[i] <= dma) {
+      break;
+    }
+    aclpci->dma_min[reading] = size;
+  }
+
+  ACL_DEBUG (KERN_DEBUG "Calibrated %s: DMA from %lu bytes, pinning from %lu bytes",
+             reading ? "reads" : "writes", aclpci->dma_min[reading], aclpci->dma_pin_min[reading]);
+}
+
+
+/* Time the memory window, the DMA bounce pool and pinned DMA at a range
+ * of sizes, and pick the transfer thresholds from that. Only done on
+ * ACLPCI_CMD_CALIBRATE_DMA. dev_addr is ACL_CALIB_MAX_SIZE bytes of global
+ * memory the caller set aside. It is read into a user buffer mapped into
+ * the calling process just for this, and the writes put the same data
+ * back. Each time is the mean of a few runs, so with the pinned page cache,
+ * pinned DMA includes a cold pin as well as cache hits. Call with
+ * aclpci->sem held. */
+int aclpci_calibrate (struct aclpci_dev *aclpci, void *dev_addr) {
+
+  size_t max_size = ACL_CALIB_MAX_SIZE;
+  void __user *user_addr;
+  unsigned long user;
+  size_t size;
+  ssize_t result;
+  u64 t, total;
+  int polling, reading, method, i, rep;
+
+  // The transfers pin pages in the owner's address space
+  if (current->mm != aclpci->user_task->mm) {
+    return -EPERM;
+  }
+  if (((unsigned long)dev_addr & DMA_ALIGNMENT_BYTE_MASK) != 0) {
+    return -EINVAL;
+  }
+
+  user = vm_mmap (NULL, 0, max_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+  if (IS_ERR_VALUE(user)) {
+    ACL_DEBUG (KERN_WARNING "Couldn't map calibration buffer");
+    return (int)user;
+  }
+  user_addr = (void __user*)user;
+
+  // Polling mode keeps the done signals from going to the user. It can
+  // only be set while DMA is idle, so nothing else is transferring.
+  polling = aclpci->dma_data.m_polling;
+  result = aclpci_dma_set_polling (aclpci, 1);
+  if (result < 0) {
+    goto done;
+  }
+  result = aclpci_rw_window (aclpci, dev_addr, user_addr, max_size, 1, 1);
+  if (result < 0) {
+    aclpci_dma_set_polling (aclpci, polling);
+    goto done;
+  }
+  result = 0;
+
+  memset (aclpci->calib_ns, 0, sizeof(aclpci->calib_ns));
+  for (reading = 0; reading < 2; reading++) {
+    for (i = 0; i < ACL_CALIB_SIZES; i++) {
+      size = (size_t)ACL_CALIB_MIN_SIZE << i;
+      for (method = 0; method < ACL_CALIB_METHODS; method++) {
+        // The memory window gets too slow to bother past 256KB
+        if ((method == ACL_CALIB_PIO && size > max_size / 4) ||
+            (method == ACL_CALIB_BOUNCE && size > ACL_PCIE_DMA_POOL_BUF_SIZE)) {
+          continue;
+        }
+        total = 0;
+        for (rep = 0; rep < ACL_CALIB_REPS; rep++) {
+          t = calib_time (aclpci, method, dev_addr, user_addr, size, reading);
+          if (t == 0) {
+            ACL_DEBUG (KERN_WARNING "Calibration transfer failed, keeping default thresholds");
+            aclpci_dma_set_polling (aclpci, polling);
+            aclpci_init_thresholds (aclpci);
+            result = -EIO;
+            goto done;
+          }
+          total += t;
+        }
+        aclpci->calib_ns[method][reading][i] = total / ACL_CALIB_REPS;
+      }
+    }
+  }
+  aclpci_dma_set_polling (aclpci, polling);
+
+  for (reading = 0; reading < 2; reading++) {
+    calib_pick (aclpci, reading);
+  }
+
+done:
+  vm_munmap (user, max_size);
+  return (int)result;
+}
+
+#else
+int aclpci_calibrate (struct aclpci_dev *aclpci, void *dev_addr) {
+  return -EINVAL;
+}
+#endif
+
+
 /* High-level read/write dispatcher.
  * There are three types of read/write based on bar_id.
  * If bar id is ACLPCI_CMD_BAR, read/write request is special command to driver.
  * If bar id is ACLPCI_DMA_BAR, read/write request is DMA request.
  * All other request should only go to host control on BAR4.
+ * If uring_cmd is not NULL, the request came through io_uring and a DMA
+ * transfer completes that command instead of signalling the user. Returns
+ * -EIOCBQUEUED then. Call with aclpci->sem held.
+ * In DMA sync mode, *sync_id is set to the transfer to wait for with
+ * aclpci_rw_wait(), once the semaphore is released.
  */
-ssize_t aclpci_rw(struct file *file, char __user *buf,
-                  size_t count, loff_t *pos,
-                  int reading) {
+static ssize_t aclpci_rw_cmd(struct aclpci_dev *aclpci, struct acl_cmd kcmd,
+                             int reading, void *uring_cmd, u64 *sync_id) {
 
-  struct aclpci_dev *aclpci = (struct aclpci_dev *)file->private_data;
-  struct acl_cmd __user *ucmd;
-  struct acl_cmd kcmd;
   u64 old_segment = 0;
   int restore_segment = 0;
   void *addr = 0;
@@ -501,21 +746,12 @@ ssize_t aclpci_rw(struct file *file, char __user *buf,
   size_t size = 0;
   int secure_range = 0;
 
-  if (down_interruptible(&aclpci->sem)) {
-    return -ERESTARTSYS;
-  }
-
-  ucmd = (struct acl_cmd __user *) buf;
-  if (copy_from_user (&kcmd, ucmd, sizeof(*ucmd))) {
-        result = -EFAULT;
-    goto done;
-    }
-
   /* Each command should ensure that the command's memory accesses are secure */
   size = kcmd.size;
+  *sync_id = 0;
   if (kcmd.bar_id == ACLPCI_CMD_BAR) {
     /* This is not a read but a special command. */
-    result = aclpci_exec_cmd (aclpci, kcmd, size);
+    result = aclpci_exec_cmd (aclpci, kcmd, size, sync_id);
     goto done;
   }
 
@@ -527,12 +763,19 @@ ssize_t aclpci_rw(struct file *file, char __user *buf,
   /* Only using DMA for large aligned reads/writes on global memory
    * (due to some assumptions inside the DMA hardware). */
   aligned = aligned_request (&kcmd, size);
-  use_dma = USE_DMA && (size >= 1024) &&
+  use_dma = USE_DMA && (size >= aclpci->dma_min[reading]) &&
             aligned && kcmd.bar_id == ACLPCI_DMA_BAR;
   ACL_VERBOSE_DEBUG (KERN_DEBUG "\n\n-----------------------");
   ACL_VERBOSE_DEBUG (KERN_DEBUG " kcmd = {%u, %p, %p}, count = %lu",
              kcmd.bar_id, (void*)kcmd.device_addr, (void*)kcmd.user_addr, size);
 
+  /* Unaligned global memory accesses DMA as much as they can */
+  if (USE_DMA && !use_dma && size >= aclpci->dma_min[reading] &&
+      size >= ACL_DMA_MIN_DEFAULT && kcmd.bar_id == ACLPCI_DMA_BAR) {
+    result = aclpci_rw_unaligned (aclpci, &kcmd, size, reading, access_le);
+    goto done;
+  }
+
   if (!use_dma) {
     /* Do bounds checking on addresses, for DMA we don't know memory size */
     if (kcmd.bar_id != ACLPCI_DMA_BAR) {
@@ -599,8 +842,13 @@ ssize_t aclpci_rw(struct file *file, char __user *buf,
   }
 
   default:
-    if (use_dma) {
-      result = aclpci_dma_rw (aclpci, kcmd.device_addr, (void __user*) kcmd.user_addr, size, reading);
+    if (use_dma && uring_cmd != NULL) {
+      result = aclpci_dma_rw_uring (aclpci, kcmd.device_addr, (void __user*) kcmd.user_addr, size, reading, uring_cmd);
+      if (result == 0) {
+        result = -EIOCBQUEUED;
+      }
+    } else if (use_dma) {
+      result = aclpci_dma_rw (aclpci, kcmd.device_addr, (void __user*) kcmd.user_addr, size, reading, sync_id);
     } else {
       result = aclpci_rw_large (addr, (void __user*) kcmd.user_addr, size, aclpci->buffer, reading, access_le );
     }
@@ -614,11 +862,55 @@ ssize_t aclpci_rw(struct file *file, char __user *buf,
   }
 
 done:
-  up (&aclpci->sem);
   return result;
 }
 
 
+/* Finish a request in DMA sync mode by waiting for the transfer
+ * aclpci_rw_cmd() queued. Called without aclpci->sem. */
+static ssize_t aclpci_rw_wait(struct aclpci_dev *aclpci, struct acl_cmd *kcmd,
+                              int reading, u64 sync_id, ssize_t result) {
+
+  int ret;
+
+  if (result < 0 || sync_id == 0) {
+    return result;
+  }
+  // Vectored transfers are driver commands, in their own direction
+  if (kcmd->bar_id == ACLPCI_CMD_BAR) {
+    reading = (kcmd->command == ACLPCI_CMD_DMA_READV);
+  }
+  ret = aclpci_dma_wait_sync (aclpci, reading, sync_id);
+  return ret < 0 ? ret : result;
+}
+
+
+ssize_t aclpci_rw(struct file *file, char __user *buf,
+                  size_t count, loff_t *pos,
+                  int reading) {
+
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)file->private_data;
+  struct acl_cmd __user *ucmd;
+  struct acl_cmd kcmd;
+  ssize_t result;
+  u64 sync_id = 0;
+
+  if (down_interruptible(&aclpci->sem)) {
+    return -ERESTARTSYS;
+  }
+
+  ucmd = (struct acl_cmd __user *) buf;
+  if (copy_from_user (&kcmd, ucmd, sizeof(*ucmd))) {
+    result = -EFAULT;
+  } else {
+    result = aclpci_rw_cmd (aclpci, kcmd, reading, NULL, &sync_id);
+  }
+
+  up (&aclpci->sem);
+  return aclpci_rw_wait (aclpci, &kcmd, reading, sync_id, result);
+}
+
+
 /* Response to user's read() call */
 ssize_t aclpci_read(struct file *file, char __user *buf,
                     size_t count, loff_t *pos) {
@@ -631,3 +923,113 @@ ssize_t aclpci_write(struct file *file, const char __user *buf,
                      size_t count, loff_t *pos) {
   return aclpci_rw (file, (char __user *)buf, count, pos, 0 /* writing */);
 }
+
+/* Map the status page at offset 0, read-only, or a DMA buffer allocated
+ * with ACLPCI_CMD_ALLOC_DMA_BUFFER at its handle */
+int aclpci_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)file->private_data;
+
+  if (vma->vm_pgoff != 0) {
+    return aclpci_dma_mmap (aclpci, vma);
+  }
+
+  if (vma->vm_end - vma->vm_start != PAGE_SIZE || (vma->vm_flags & VM_WRITE)) {
+    return -EINVAL;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY, VM_MAYWRITE);
+#else
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+  return remap_pfn_range (vma, vma->vm_start, virt_to_phys(aclpci->status_page) >> PAGE_SHIFT,
+                          PAGE_SIZE, vma->vm_page_prot);
+}
+
+
+/* Readable while a kernel done interrupt is waiting to be acknowledged,
+ * writable while all submitted DMA transfers are done. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+__poll_t aclpci_poll(struct file *file, poll_table *wait) {
+  __poll_t mask = 0;
+#else
+unsigned int aclpci_poll(struct file *file, poll_table *wait) {
+  unsigned int mask = 0;
+#endif
+
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)file->private_data;
+
+  poll_wait(file, &aclpci->wait_q, wait);
+
+  if (aclpci->kernel_irq_pending) {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  if (aclpci_dma_get_completed_id(aclpci) == aclpci_dma_get_submitted_id(aclpci)) {
+    mask |= POLLOUT | POLLWRNORM;
+  }
+  return mask;
+}
+
+
+#if ACL_URING_CMD
+/* Post the result of a queued io_uring command, from the submitter's task */
+static void aclpci_uring_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+  io_uring_cmd_done(ioucmd, *(ssize_t *)ioucmd->pdu, 0, issue_flags);
+}
+
+/* Complete an io_uring command queued by aclpci_uring_cmd(). Can be called
+ * from any context. */
+void aclpci_uring_complete (void *uring_cmd, ssize_t res) {
+  struct io_uring_cmd *ioucmd = (struct io_uring_cmd *)uring_cmd;
+
+  *(ssize_t *)ioucmd->pdu = res;
+  io_uring_cmd_complete_in_task(ioucmd, aclpci_uring_done);
+}
+
+/* Whether aclpci_rw_cmd() only queues a DMA transfer for kcmd, and
+ * returns without waiting for the device. Same checks as it makes. */
+static int uring_queues_dma (struct aclpci_dev *aclpci, struct acl_cmd *kcmd, int reading) {
+  return USE_DMA && kcmd->bar_id == ACLPCI_DMA_BAR &&
+         kcmd->size > sizeof(u64) && kcmd->size >= aclpci->dma_min[reading] &&
+         aligned_request(kcmd, kcmd->size);
+}
+
+/* io_uring passthrough. The SQE carries a struct acl_cmd, handled the same
+ * as read() or write() of it, depending on cmd_op. */
+int aclpci_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+
+  struct aclpci_dev *aclpci = (struct aclpci_dev *)ioucmd->file->private_data;
+  struct acl_cmd kcmd;
+  ssize_t result;
+  u64 sync_id;
+  int reading;
+
+  if (!(issue_flags & IO_URING_F_SQE128)) {
+    return -EINVAL;
+  }
+  if (ioucmd->cmd_op != ACLPCI_URING_READ && ioucmd->cmd_op != ACLPCI_URING_WRITE) {
+    return -EINVAL;
+  }
+  memcpy (&kcmd, io_uring_sqe_cmd(ioucmd->sqe), sizeof(kcmd));
+  reading = (ioucmd->cmd_op == ACLPCI_URING_READ);
+
+  // Called without blocking first. Only queueing a DMA transfer is quick
+  // enough for that. Everything else, or a busy device, makes io_uring
+  // issue the command again from a worker that can wait.
+  if (issue_flags & IO_URING_F_NONBLOCK) {
+    if (!uring_queues_dma(aclpci, &kcmd, reading) ||
+        down_trylock(&aclpci->sem)) {
+      return -EAGAIN;
+    }
+  } else if (down_interruptible(&aclpci->sem)) {
+    return -EINTR;
+  }
+
+  result = aclpci_rw_cmd (aclpci, kcmd, reading, ioucmd, &sync_id);
+
+  up (&aclpci->sem);
+  return aclpci_rw_wait (aclpci, &kcmd, reading, sync_id, result);
+}
+#else
+void aclpci_uring_complete (void *uring_cmd, ssize_t res) {}
+#endif
@@ -111,7 +111,6 @@ const unsigned int PLL_ENABLE_CAL_REG_S10 		= 330;
 int aclpci_pr (struct aclpci_dev *aclpci, void __user* core_bitstream, ssize_t len, int __user* pll_config_array) {
 
   struct pci_dev *dev = NULL;
-  struct aclpci_dma *d = &(aclpci->dma_data);
   char *data;
   int pll_config_array_local[8];
   int i=0, j=0, idle;
@@ -255,17 +254,17 @@ int aclpci_pr (struct aclpci_dev *aclpci, void __user* core_bitstream, ssize_t l
     ACL_DEBUG (KERN_DEBUG "Size of PR RBF is 0x%08X, initiating DMA transfer to PR IP", (int) len);
 
     /* Write PR bitstream using DMA */
-    status = aclpci_dma_rw (aclpci, (void*) ACL_PCIE_PR_DMA_OFFSET, core_bitstream, len, 0);
+    status = aclpci_dma_rw (aclpci, (void*) ACL_PCIE_PR_DMA_OFFSET, core_bitstream, len, 0, NULL);
 
     /* Wait for DMA being idle */
     startdma = get_jiffies_64();
-    idle=d->m_idle;
+    idle=aclpci_dma_get_idle_status(aclpci);
     i=0;
     while(idle != 1)
     {
       msleep(1);
       i++;
-      idle=d->m_idle;
+      idle=aclpci_dma_get_idle_status(aclpci);
     };
     enddma = get_jiffies_64();
     ACL_DEBUG (KERN_DEBUG "PR DMA took %u ms, DMA idle status is %d", (jiffies_to_usecs(enddma-startdma)/1000), idle);
@@ -135,8 +135,8 @@ void queue_push (struct queue *q, void *e) {
   // The following checks are for memcpy(dest, e, q->elem_size).
   // If there's a failure, print an error message and return from the function without changing anything
   // 1. e and dest can't overlap.
-  if ( (e + q->elem_size > dest) ||   //end of e overlap with begin of dest
-       (e < dest + q->elem_size) )  { //begin of e overlap with end of dest
+  if ( (e < dest + q->elem_size) &&   //begin of e is before end of dest
+       (dest < e + q->elem_size) )  {  //begin of dest is before end of e
     printk("queue_push() failed at memcpy(): Source and Destination buffers overlap");
     return;
   }
@@ -64,6 +64,9 @@
 // of Arria 10 PCIe HIP set to Avalon-MM with DMA type
 #define ACL_PCIE_DMA_DESC_MAX_ENTRIES                128
 
+// Transfer length field of a descriptor (ctl_dma_len[17:0]), in dwords
+#define ACL_PCIE_DMA_DESC_MAX_DWORDS             0x3FFFF
+
 // Host channel Maximum number of page entries
 #define HOSTCH_MAX_PAGE_ENTRIES			  0x1000
 
@@ -80,11 +80,24 @@
 #define ACLPCI_CMD_SAVE_PCI_CONTROL_REGS  1
 #define ACLPCI_CMD_LOAD_PCI_CONTROL_REGS  2
 
-/* Lock/Unlock user_addr memory to physical RAM ("pin" it) */
+/* Lock/Unlock user_addr memory to physical RAM ("pin" it).
+ * PIN_USER_ADDR registers 'size' bytes at user_addr for DMA and writes a
+ * u32 handle to device_addr. DMA transfers that fall inside a registered
+ * buffer don't pin and unpin its pages again.
+ * UNPIN_USER_ADDR reads the u32 handle from device_addr and releases the
+ * buffer. Fails with EBUSY while a transfer is using it.
+ * The pages count against RLIMIT_MEMLOCK, PIN_USER_ADDR fails with ENOMEM
+ * past it. Handles stay valid across SAVE/LOAD_PCI_CONTROL_REGS, and
+ * buffers still registered are released on close. */
 #define ACLPCI_CMD_PIN_USER_ADDR          3
 #define ACLPCI_CMD_UNPIN_USER_ADDR        4
 
-/* Get m_idle status of DMA */
+/* Get m_idle status of DMA.
+ * In polling mode (see SET_DMA_POLLING), DMA_UPDATE moves the DMA transfers
+ * along from the calling thread and returns once all transfers submitted
+ * so far are done. It spins on the descriptor status for a while, then
+ * sleeps between checks, without holding up other commands to the device.
+ * Outside of polling mode it does nothing. */
 #define ACLPCI_CMD_GET_DMA_IDLE_STATUS    5
 #define ACLPCI_CMD_DMA_UPDATE             6
 
@@ -138,7 +151,87 @@
 
 #define ACLPCI_CMD_HOSTCH_THREAD_SYNC     26
 
-#define ACLPCI_CMD_MAX_CMD                27
+/* DMA transfers are queued, so a new one can be submitted before the
+ * previous one is done. Each transfer gets an id, increasing by one per
+ * submission, and transfers complete in the order they were submitted.
+ * Both commands write a u64 to user_addr:
+ *   GET_DMA_SUBMITTED_ID -- id of the most recently submitted transfer
+ *   GET_DMA_COMPLETED_ID -- all transfers with id <= this value are done */
+#define ACLPCI_CMD_GET_DMA_SUBMITTED_ID   27
+#define ACLPCI_CMD_GET_DMA_COMPLETED_ID   28
+
+/* Allocate a DMA buffer owned by the driver, of 'size' bytes rounded up to
+ * whole pages. A u32 handle is written to device_addr. Map the buffer with
+ *   mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, handle * page_size)
+ * DMA from/to the mapping needs no pinning and is always 64-byte aligned on
+ * the host side. FREE_DMA_BUFFER reads the handle from device_addr and
+ * frees the buffer. It fails with EBUSY while the buffer is mapped.
+ * Buffers are at most 256MB, and count against RLIMIT_MEMLOCK: ALLOC fails
+ * with EINVAL or ENOMEM past that. Buffers still allocated on close are
+ * freed once their last mapping goes away. */
+#define ACLPCI_CMD_ALLOC_DMA_BUFFER       29
+#define ACLPCI_CMD_FREE_DMA_BUFFER        30
+
+/* Read a u32 from user_addr. If it is 1, DMA transfers are no longer moved
+ * along by interrupts, and no signal is sent when they are done: the user
+ * calls DMA_UPDATE instead. 0 goes back to interrupts. Fails with EBUSY
+ * while DMA is not idle. The mode is a device setting, not one of the
+ * handle: DMA_UPDATE from any thread moves every queued transfer along. */
+#define ACLPCI_CMD_SET_DMA_POLLING        31
+
+/* Vectored DMA. user_addr points to an array of 'size' struct
+ * acl_dma_segment, at most 256. DMA_WRITEV copies each segment from host to
+ * device memory, DMA_READV from device to host memory. Every segment has
+ * to be 64-byte aligned, like a DMA through read()/write(). The segments
+ * are queued as one transfer each, so they count towards the submitted
+ * and completed ids, but the done signal is only sent after the last
+ * one. */
+#define ACLPCI_CMD_DMA_WRITEV             32
+#define ACLPCI_CMD_DMA_READV              33
+
+/* Register an eventfd to be signalled instead of sending a signal.
+ * device_addr selects the event (ACLPCI_EVENT_*), and user_addr points to
+ * an int holding the eventfd's file descriptor, or -1 to go back to
+ * signals. The eventfds are released on close.
+ *
+ * The device file can also be poll()ed. It is readable while a kernel done
+ * interrupt hasn't been acknowledged with ENABLE_KERNEL_IRQ, and writable
+ * while all submitted DMA transfers are done. */
+#define ACLPCI_CMD_SET_EVENTFD            34
+
+/* Read a u32 timeout in ms from user_addr. If it isn't 0, read() and
+ * write() of DMA transfers (and DMA_WRITEV/READV) only return once the
+ * transfer is done, and no done signal is sent for it. If it takes longer
+ * than the timeout they fail with ETIMEDOUT, and with EINTR if a signal
+ * comes in. The transfer is still queued then, and completes as usual.
+ * ACLPCI_DMA_SYNC_FOREVER waits without a timeout, and 0 goes back to
+ * returning right after the transfer is queued. Reset on open. */
+#define ACLPCI_CMD_SET_DMA_SYNC           35
+#define ACLPCI_DMA_SYNC_FOREVER           0xffffffff
+
+/* Time the memory window, bounce buffer DMA and pinned DMA at sizes from
+ * 1KB to 1MB, and set the transfer thresholds from the results (see the
+ * dma_* attributes of the device in sysfs). device_addr is 1MB of global
+ * memory set aside for this, DMA aligned. It is overwritten with its own
+ * contents, so nothing else may access it meanwhile. Fails with EBUSY
+ * unless DMA is idle. Never done otherwise: the thresholds keep their
+ * defaults. */
+#define ACLPCI_CMD_CALIBRATE_DMA          36
+
+#define ACLPCI_CMD_MAX_CMD                37
+
+/* Events for ACLPCI_CMD_SET_EVENTFD */
+#define ACLPCI_EVENT_KERNEL               0   /* kernel done interrupt */
+#define ACLPCI_EVENT_DMA                  1   /* DMA transfer done */
+
+/* io_uring passthrough (IORING_OP_URING_CMD, on kernels that have it).
+ * The ring must be set up with IORING_SETUP_SQE128. The command area of
+ * the SQE holds a struct acl_cmd, and cmd_op is one of these, to handle it
+ * like read() or write() of that acl_cmd would. A DMA transfer gets its
+ * completion when the transfer is done, without a done signal. Everything
+ * else completes right away. */
+#define ACLPCI_URING_READ                 0
+#define ACLPCI_URING_WRITE                1
 
 /* Signal from driver to user (hal) to notify about hw interrupt */
 /* This is now obsolete, when the MMD is opened it will dynamically
@@ -174,4 +267,54 @@ struct acl_cmd {
   int is_diff_endian;
 };
 
+/* One segment of a vectored DMA transfer */
+struct acl_dma_segment {
+  /* Address in device space (same as acl_cmd on ACLPCI_DMA_BAR) */
+  void* device_addr;
+
+  /* Address in user space */
+  void* user_addr;
+
+  size_t size;
+};
+
+/* Status page. mmap() one page of the device at offset 0, read-only:
+ *   mmap (NULL, page_size, PROT_READ, MAP_SHARED, f, 0)
+ * The driver keeps it up to date, so completions can be polled with plain
+ * loads instead of commands. It is reset on open.
+ *
+ * Every DMA transfer that retires adds an entry to ring. ring_head counts
+ * the entries written so far, and entry n is in
+ * ring[n % ACLPCI_STATUS_RING_ENTRIES]. The entry is written before
+ * ring_head moves, so read ring_head first, then the entries below it. A
+ * reader that falls more than ACLPCI_STATUS_RING_ENTRIES behind loses
+ * entries, but dma_completed_id is always current. */
+#define ACLPCI_STATUS_RING_ENTRIES        128
+
+struct acl_status_entry {
+  /* Transfer id, as in GET_DMA_SUBMITTED_ID */
+  unsigned long long id;
+
+  /* 0 if the transfer is done, or a negative errno if it was dropped,
+   * e.g. by DMA_STOP */
+  long long status;
+};
+
+struct acl_status_page {
+  /* Same as GET_DMA_SUBMITTED_ID, GET_DMA_COMPLETED_ID and
+   * GET_DMA_IDLE_STATUS would return */
+  volatile unsigned long long dma_submitted_id;
+  volatile unsigned long long dma_completed_id;
+  volatile unsigned int dma_idle;
+
+  /* 1 while a kernel done interrupt waits for ENABLE_KERNEL_IRQ */
+  volatile unsigned int kernel_irq_pending;
+
+  /* Number of kernel done interrupts since open */
+  volatile unsigned long long kernel_irq_count;
+
+  volatile unsigned long long ring_head;
+  struct acl_status_entry ring[ACLPCI_STATUS_RING_ENTRIES];
+};
+
 #endif /* PCIE_LINUX_DRIVER_EXPORTS_H */